@@ -1,8 +1,41 @@
 /* {{{ Includes */
+#include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <getopt.h>
+#include <glob.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 #include <math.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+// GCC 12 warns about the self-initialised _mm512_undefined_*() placeholders
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#endif
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
 #include "escape.h"
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -24,6 +57,210 @@
 #endif
 /* }}} */
 
+/* {{{ Thread pool */
+// Data cache misses of the calling thread in user space, from the level 1
+// data cache and the last level cache, through Linux perf events. Counts
+// read -1 where the CPU or kernel does not provide them.
+struct CacheCounters
+{
+	CacheCounters() : fd{-1, -1}, opened(false) {}
+	~CacheCounters()
+	{
+		for (int f: fd)
+			if (f >= 0)
+				close(f);
+	}
+
+	void read(long long misses[2])
+	{
+#ifdef __linux__
+		static const uint64_t configs[2][2] = {
+			{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+			 PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+		};
+		for (int i = 0; !opened && i != 2; i++) {
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = configs[i][0];
+			attr.config = configs[i][1];
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+#endif
+		opened = true;
+		for (int i = 0; i != 2; i++) {
+			uint64_t v;
+			misses[i] = fd[i] >= 0 && ::read(fd[i], &v, sizeof(v)) == sizeof(v) ? (long long)v : -1;
+		}
+	}
+
+private:
+	int fd[2];
+	bool opened;
+};
+
+struct ThreadPool
+{
+	struct Stats
+	{
+		int tasks;
+		struct timeval busy;
+		// Level 1 data and last level cache misses while busy, -1 if not
+		// counted
+		long long misses[2];
+	};
+
+	ThreadPool() : tasks(0), active(0), generation(0), quit(false), counting(false), func(0) {}
+	~ThreadPool() { stop(); }
+
+	// Spawn n worker threads, n <= 1 runs everything on the calling thread.
+	// With counting, cache misses of every run are added to the stats.
+	void start(int n, bool counting = false);
+	void stop();
+	// Run func(task) for every task in [0, tasks), returns when all are done
+	void run(int tasks, const std::function<void(int task)> &func);
+
+	int threads() const { return stats.size(); }
+	const Stats &stat(int thread) const { return stats[thread]; }
+
+private:
+	void worker(int id);
+	void process(int id);
+
+	std::vector<std::thread> workers;
+	std::vector<Stats> stats;
+	std::mutex mutex;
+	std::condition_variable cvStart, cvDone;
+	std::atomic<int> next;
+	int tasks, active;
+	unsigned long generation;
+	bool quit, counting;
+	const std::function<void(int task)> *func;
+};
+
+void ThreadPool::start(int n, bool counting)
+{
+	stop();
+	this->counting = counting;
+	stats.assign(n > 1 ? n : 1, Stats());
+	if (n <= 1)
+		return;
+	quit = false;
+	for (int i = 0; i != n; i++)
+		workers.push_back(std::thread(&ThreadPool::worker, this, i));
+}
+
+void ThreadPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	cvStart.notify_all();
+	for (std::thread &t: workers)
+		t.join();
+	workers.clear();
+}
+
+void ThreadPool::run(int tasks, const std::function<void(int task)> &func)
+{
+	this->func = &func;
+	this->tasks = tasks;
+	next = 0;
+	if (workers.empty()) {
+		process(0);
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	active = workers.size();
+	generation++;
+	cvStart.notify_all();
+	cvDone.wait(lock, [this] { return active == 0; });
+}
+
+void ThreadPool::worker(int id)
+{
+	unsigned long gen = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		cvStart.wait(lock, [&] { return quit || generation != gen; });
+		if (quit)
+			return;
+		gen = generation;
+		lock.unlock();
+		process(id);
+		lock.lock();
+		if (--active == 0)
+			cvDone.notify_one();
+	}
+}
+
+void ThreadPool::process(int id)
+{
+	// Opened by the thread they count
+	static thread_local CacheCounters counters;
+	struct timeval tStart, tEnd;
+	long long m0[2] = {-1, -1}, m1[2] = {-1, -1};
+	int n = 0;
+	if (counting)
+		counters.read(m0);
+	gettimeofday(&tStart, NULL);
+	for (int task; (task = next++) < tasks; n++)
+		(*func)(task);
+	gettimeofday(&tEnd, NULL);
+	if (counting)
+		counters.read(m1);
+	timersub(&tEnd, &tStart, &stats[id].busy);
+	stats[id].tasks = n;
+	for (int i = 0; i != 2; i++)
+		stats[id].misses[i] = m0[i] >= 0 && m1[i] >= 0 ? m1[i] - m0[i] : -1;
+}
+
+// Bounded FIFO between pipeline stages, pop fails once the queue is
+// closed and drained
+template <class T>
+struct Queue
+{
+	Queue(size_t capacity) : capacity(capacity), closed(false) {}
+
+	void push(const T &v)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [this]() { return items.size() < capacity; });
+		items.push_back(v);
+		notEmpty.notify_one();
+	}
+	bool pop(T *v)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [this]() { return !items.empty() || closed; });
+		if (items.empty())
+			return false;
+		*v = items.front();
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		notEmpty.notify_all();
+	}
+
+private:
+	size_t capacity;
+	bool closed;
+	std::deque<T> items;
+	std::mutex mutex;
+	std::condition_variable notEmpty, notFull;
+};
+/* }}} */
+
 /* {{{ Vector maths */
 struct vec2
 {
@@ -49,210 +286,4604 @@ struct vec3
 
 	float x, y, z;
 };
+
+// Rotation of column vectors, r being the rows
+struct mat3
+{
+	mat3() : r{vec3(1., 0., 0.), vec3(0., 1., 0.), vec3(0., 0., 1.)} {}
+	mat3(const vec3 &a, const vec3 &b, const vec3 &c) : r{a, b, c} {}
+	vec3 operator*(const vec3 &v) const
+	{
+		return vec3(r[0].dot(v), r[1].dot(v), r[2].dot(v));
+	}
+	mat3 operator*(const mat3 &m) const
+	{
+		mat3 t = m.transposed();
+		return mat3(t * r[0], t * r[1], t * r[2]);
+	}
+	mat3 transposed() const
+	{
+		return mat3(vec3(r[0].x, r[1].x, r[2].x), vec3(r[0].y, r[1].y, r[2].y), vec3(r[0].z, r[1].z, r[2].z));
+	}
+
+	vec3 r[3];
+};
+/* }}} */
+
+/* {{{ Component types */
+// Texel component types, templated code takes the matching C++ type
+enum Type {TypeU8, TypeU16, TypeHalf, TypeFloat, TypeCount};
+static const char *const typeNames[TypeCount] = {"u8", "u16", "half", "float"};
+static const int typeSizes[TypeCount] = {1, 2, 2, 4};
+
+// IEEE 754 binary16, only ever converted to and from float
+struct half
+{
+	uint16_t bits;
+};
+
+static inline float halfToFloat(uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16, e = h >> 10 & 0x1f, m = h & 0x3ff, bits;
+	if (e == 0x1f) {
+		bits = sign | 0x7f800000 | m << 13;
+	} else if (e) {
+		bits = sign | (e + 112) << 23 | m << 13;
+	} else {
+		// Subnormal, m * 2^-24
+		float f = m * (1.f / 16777216.f);
+		return sign ? -f : f;
+	}
+	float f;
+	memcpy(&f, &bits, 4);
+	return f;
+}
+
+// Rounded to nearest even, overflowing to infinity
+static inline uint16_t floatToHalf(float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, 4);
+	uint16_t sign = bits >> 16 & 0x8000;
+	uint32_t a = bits & 0x7fffffff;
+	if (a >= 0x7f800000)
+		return sign | 0x7c00 | (a > 0x7f800000 ? 0x200 : 0);
+	if (a >= 0x477ff000)
+		return sign | 0x7c00;
+	if (a < 0x38800000) {
+		// Subnormal, the float addition does the rounding
+		float r = fabsf(f) + 0.5f;
+		memcpy(&a, &r, 4);
+		return sign | (a - 0x3f000000);
+	}
+	a += ((a >> 13) & 1) + 0xfff;
+	return sign | ((a - 0x38000000) >> 13);
+}
+
+// Arithmetic on components of type T:
+//   Value    Type filters compute in, exact integers for integer types
+//   scale    Value of full intensity
+//   get/put  Conversion between T and Value
+//   lerp     a + (b - a) * f / 256, rounded as the 8-bit SIMD kernels
+//   box      Mean of four values
+//   round    Nearest T of a filtered float value
+template <class T>
+struct Component
+{
+	typedef int Value;
+	static constexpr float scale = (T)~0;
+
+	static inline int get(T v) { return v; }
+	static inline T put(int v) { return v; }
+	static inline int lerp(int a, int b, int f) { return (a * (256 - f) + b * f + 128) >> 8; }
+	static inline int box(int a, int b, int c, int d) { return (a + b + c + d + 2) >> 2; }
+	static inline T round(float v) { return v <= 0.f ? 0 : v >= scale ? (T)~0 : (T)lrintf(v); }
+};
+
+template <>
+struct Component<float>
+{
+	typedef float Value;
+	static constexpr float scale = 1.;
+
+	static inline float get(float v) { return v; }
+	static inline float put(float v) { return v; }
+	static inline float lerp(float a, float b, int f) { return a + (b - a) * (f * (1.f / 256.f)); }
+	static inline float box(float a, float b, float c, float d) { return (a + b + c + d) * 0.25f; }
+	// Negative radiance from bicubic overshoot is clamped
+	static inline float round(float v) { return v > 0.f ? v : 0.f; }
+};
+
+template <>
+struct Component<half> : Component<float>
+{
+	static inline float get(half v) { return halfToFloat(v.bits); }
+	static inline half put(float v) { return half{floatToHalf(v)}; }
+	static inline half round(float v) { return put(Component<float>::round(v)); }
+};
+
+// Call f with a value of the C++ type of component type t
+template <class F>
+static inline void with_component(Type t, F f)
+{
+	switch (t) {
+	case TypeU8:
+		f(uint8_t());
+		break;
+	case TypeU16:
+		f(uint16_t());
+		break;
+	case TypeHalf:
+		f(half());
+		break;
+	default:
+		f(float());
+		break;
+	}
+}
 /* }}} */
 
 /* {{{ Image storage */
+// Arrangement of the six faces of a cube map target in the stored image,
+// in grid cells of one face each. 3x2 is the YouTube equi-angular cubemap
+// arrangement, left, front and right above down, back and up, the bottom
+// row turned a quarter so that its edges join
+enum Layout {LayoutStrip, Layout3x2, LayoutHCross, LayoutVCross, LayoutFaces, LayoutCount};
+static const char *const layoutNames[LayoutCount] = {"strip", "3x2", "hcross", "vcross", "faces"};
+
+// Face texel orientation: native faces read as seen from the centre of
+// the cube, gl faces as the GL cube map face table, which Direct3D and
+// Vulkan share: every native face mirrored horizontally, the other way
+// round. Layouts then swap +X and -X so that the net stays joined.
+enum FaceOrientation {FacesNative, FacesGl, FaceOrientationCount};
+static const char *const faceOrientationNames[FaceOrientationCount] = {"native", "gl"};
+
+// Storage of the faces of a target s texels wide: texel (u, v) of face f
+// is at texel index origin[f] + u * du[f] + v * dv[f] of a w x h image,
+// so that layouts and orientations only change where renderers write
+struct FaceLayout
+{
+	void build(Layout layout, FaceOrientation orientation, int s)
+	{
+		// Grid size, then column, row and clockwise quarter turns of the
+		// +X, -X, +Y, -Y, +Z and -Z faces of each orientation. +Z is the
+		// front face, left of it +X for native faces and -X for gl ones,
+		// so that the crosses and the rows of 3x2 join at every edge.
+		static const int grids[LayoutCount][2] = {{6, 1}, {3, 2}, {4, 3}, {3, 4}, {1, 6}};
+		static const int cells[FaceOrientationCount][LayoutCount][6][3] = {
+			{
+				{{0, 0, 0}, {1, 0, 0}, {2, 0, 0}, {3, 0, 0}, {4, 0, 0}, {5, 0, 0}},
+				{{0, 0, 0}, {2, 0, 0}, {2, 1, 3}, {0, 1, 3}, {1, 0, 0}, {1, 1, 1}},
+				{{0, 1, 0}, {2, 1, 0}, {1, 0, 0}, {1, 2, 0}, {1, 1, 0}, {3, 1, 0}},
+				{{0, 1, 0}, {2, 1, 0}, {1, 0, 0}, {1, 2, 0}, {1, 1, 0}, {1, 3, 2}},
+				{{0, 0, 0}, {0, 1, 0}, {0, 2, 0}, {0, 3, 0}, {0, 4, 0}, {0, 5, 0}},
+			}, {
+				{{0, 0, 0}, {1, 0, 0}, {2, 0, 0}, {3, 0, 0}, {4, 0, 0}, {5, 0, 0}},
+				{{2, 0, 0}, {0, 0, 0}, {2, 1, 3}, {0, 1, 3}, {1, 0, 0}, {1, 1, 1}},
+				{{2, 1, 0}, {0, 1, 0}, {1, 0, 0}, {1, 2, 0}, {1, 1, 0}, {3, 1, 0}},
+				{{2, 1, 0}, {0, 1, 0}, {1, 0, 0}, {1, 2, 0}, {1, 1, 0}, {1, 3, 2}},
+				{{0, 0, 0}, {0, 1, 0}, {0, 2, 0}, {0, 3, 0}, {0, 4, 0}, {0, 5, 0}},
+			},
+		};
+		this->s = s;
+		faces = 6;
+		cols = grids[layout][0];
+		rows = grids[layout][1];
+		w = cols * s;
+		h = rows * s;
+		used = 0;
+		const bool mirror = orientation == FacesGl;
+		for (int f = 0; f != 6; f++) {
+			const int *c = cells[orientation][layout][f];
+			used |= 1u << (c[1] * cols + c[0]);
+			auto at = [=](int u, int v) {
+				int x = mirror ? s - 1 - u : u, y = v, t;
+				for (int q = 0; q != c[2]; q++) {
+					t = x;
+					x = s - 1 - y;
+					y = t;
+				}
+				return (ptrdiff_t)(c[1] * s + y) * w + c[0] * s + x;
+			};
+			origin[f] = at(0, 0);
+			du[f] = at(1, 0) - origin[f];
+			dv[f] = at(0, 1) - origin[f];
+		}
+	}
+
+	// Faces in a horizontal strip of a faces x 1 grid, as kernels write
+	// targets without a layout
+	void strip(int faces, int s, int h)
+	{
+		this->s = s;
+		this->faces = faces;
+		cols = faces;
+		rows = 1;
+		w = faces * s;
+		this->h = h;
+		used = (1u << faces) - 1;
+		for (int f = 0; f != faces; f++) {
+			origin[f] = (ptrdiff_t)f * s;
+			du[f] = 1;
+			dv[f] = w;
+		}
+	}
+
+	inline ptrdiff_t at(int f, int u, int v) const { return origin[f] + u * du[f] + v * dv[f]; }
+	// Zero the grid cells without a face, of texel bytes per texel
+	void clearGaps(void *ptr, size_t texel) const
+	{
+		for (int c = 0; c != cols * rows; c++)
+			if (!(used >> c & 1))
+				for (int y = 0; y != s; y++)
+					memset((uint8_t *)ptr + ((size_t)(c / cols * s + y) * w + c % cols * s) * texel, 0, s * texel);
+	}
+
+	int s, faces, cols, rows, w, h;
+	// Grid cells holding a face, bit row * cols + column
+	uint32_t used;
+	ptrdiff_t origin[6], du[6], dv[6];
+};
+
 struct Image
 {
-	bool load(char *path) { return !!(ptr = stbi_load(path, &w, &h, &n, 3)); }
-	bool alloc() { return !!(ptr = malloc(w * h * n)); }
+	// Grey, RGB or RGBA components of the type stored in the file, grey
+	// with alpha loads as RGBA, see fileType
+	bool load(const char *path);
+	// Float for Radiance HDR, 16-bit for 16-bit PNG, 8-bit otherwise
+	static Type fileType(const char *path);
+	// Padded as in load, any image may be a source
+	bool alloc() { return !!(ptr = malloc(bytes() + 4)); }
+	size_t texel() const { return (size_t)n * typeSizes[type]; }
+	// Storage of the faces of a target with the given number of faces
+	FaceLayout faces(int n) const
+	{
+		FaceLayout l;
+		if (layout)
+			l = *layout;
+		else
+			l.strip(n, w / n, h);
+		return l;
+	}
+	// Texels stored, including those padding tiles or around faces
+	size_t texels() const
+	{
+		const int m = (1 << tile) - 1;
+		return layout ? (size_t)layout->w * layout->h : (size_t)((w + m) >> tile) * ((h + m) >> tile) << 2 * tile;
+	}
+	size_t bytes() const { return texels() * texel(); }
+	// Swap the first and third channels of 8-bit texels, RGB to BGR and back
+	void swapRB()
+	{
+		uint8_t *p = (uint8_t *)ptr, *e = p + texels() * n;
+		for (; n >= 3 && p != e; p += n) {
+			uint8_t t = p[0];
+			p[0] = p[2];
+			p[2] = t;
+		}
+	}
 
 	static float warp(const float v) { return v + -floorf(v); }
-	void *uv(const vec2 &uv)
+	// Texel sampled at uv, wrapped in longitude and clamped at the poles
+	void nearest(const vec2 &uv, int *x, int *y) const
 	{
-		int u = (int)roundf(warp(uv.x) * w) % w;
-		int v = (int)roundf(warp(uv.y) * h) % h;
-		return (uint8_t *)ptr + (v * w + u) * n;
+		int v = (int)roundf(uv.y * h);
+		*x = (int)roundf(warp(uv.x) * w) % w;
+		*y = v < 0 ? 0 : v < h ? v : h - 1;
 	}
-	const void *uv(const vec2 &uv) const
+	// Row major index of the nearest texel, whatever the layout
+	uint32_t index(const vec2 &uv) const
 	{
-		int u = (int)roundf(warp(uv.x) * w) % w;
-		int v = (int)roundf(warp(uv.y) * h) % h;
-		return (uint8_t *)ptr + (v * w + u) * n;
+		int x, y;
+		nearest(uv, &x, &y);
+		return (uint32_t)y * w + x;
 	}
+	void *uv(const vec2 &uv) { return (uint8_t *)ptr + index(uv) * texel(); }
+	const void *uv(const vec2 &uv) const { return (uint8_t *)ptr + index(uv) * texel(); }
 	vec2 uvToCoordinate(const vec2 &uv) { return vec2((int)roundf(warp(uv.x) * w) % w, (int)roundf(warp(uv.y) * h) % h); }
+	// Texel coordinates sampled at uv in 24.8 fixed point, wrapped in
+	// longitude and clamped at the poles
+	struct Coord
+	{
+		int32_t x, y;
+	};
+	Coord coord(const vec2 &uv) const
+	{
+		int32_t x = lrintf(warp(uv.x) * w * 256.f), y = lrintf(uv.y * h * 256.f);
+		const int32_t ymax = (h - 1) * 256;
+		Coord c = {x < w * 256 ? x : 0, y < 0 ? 0 : y < ymax ? y : ymax};
+		return c;
+	}
 
 	int w, h, n;
 	void *ptr;
+	// Zero for brace initialised 8-bit images
+	Type type;
+	// Texels are stored in square tiles 1 << tile wide, rows of tiles
+	// padded to whole tiles, see TiledLayout; zero for rows of texels
+	int tile;
+	// Faces of a cube map target stored as laid out, w x h being the
+	// faces in a strip; null for the strip itself
+	const FaceLayout *layout;
 };
-/* }}} */
 
-/* {{{ Transformations */
-static inline vec2 euclideanToLatLong(const vec3 &vec)
+// Texel addressing of the source layouts, samplers take one as template
+// argument. Every image can be read as TiledLayout, RowLayout is faster
+// for images stored in rows.
+struct RowLayout
 {
-	return vec2(atan2f(vec.z, vec.x), acosf(vec.normalized().dot(vec3(0., 1., 0.))));
-}
+	static inline size_t at(const Image *img, int x, int y) { return (size_t)y * img->w + x; }
+};
 
-/* {{{ LatLong transformations */
-static inline vec2 latLong_latLongToUV(const vec2 &vec)
+struct TiledLayout
+{
+	static inline size_t at(const Image *img, int x, int y)
+	{
+		const int k = img->tile, m = (1 << k) - 1;
+		const size_t tiles = (img->w + m) >> k;
+		return (((size_t)(y >> k) * tiles + (x >> k)) << 2 * k) + ((y & m) << k) + (x & m);
+	}
+};
+
+// Call f with values of the component type of img and of
+// std::integral_constant of its 1, 3 or 4 channels, so that samplers are
+// specialised for both
+template <class F>
+static inline void with_texel(const Image *img, F f)
 {
-	return vec2(vec.x / 2. / M_PI, vec.y / M_PI);
+	with_component(img->type, [=](auto t) {
+		switch (img->n) {
+		case 1:
+			f(t, std::integral_constant<int, 1>());
+			break;
+		case 4:
+			f(t, std::integral_constant<int, 4>());
+			break;
+		default:
+			f(t, std::integral_constant<int, 3>());
+			break;
+		}
+	});
 }
 /* }}} */
 
-/* {{{ Cubemap transformations */
-static inline void cubemap_targetSize(Image *img, int *w, int *h)
-{
-	float x = sqrtf((float)(img->w * img->h) / 6.);
-	*h = roundf(x);
-	*w = *h * 6;
-}
-
-static inline vec3 cubemap_uvToEuclidean(const vec2 &vec, const unsigned int face)
-{
-	float u = vec.x * 2. - 1.;
-	float v = vec.y * 2. - 1.;
-	switch (face) {
-	case 0:		// +X
-		return vec3(1., -v, u);
-	case 1:		// -X
-		return vec3(-1., -v, -u);
-	case 2:		// +Y
-		return vec3(-u, 1., v);
-	case 3:		// -Y
-		return vec3(-u, -1., -v);
-	case 4:		// +Z
-		return vec3(-u, -v, 1);
-	default:	// -Z
-		return vec3(u, -v, -1);
-	};
-}
+/* {{{ Sampling filters */
+enum Filter {FilterNearest, FilterBilinear, FilterBicubic, FilterArea, FilterCount};
+static const char *const filterNames[FilterCount] = {"nearest", "bilinear", "bicubic", "area"};
 
-static inline vec3 cubemap_uvToEuclidean(const vec2 &vec)
+// Filters write the source sampled at uv, or at fixed point texel
+// coordinates, to the N components at p, of the source component type.
+// N is the source channel count, fixed at compile time so that texels
+// are copied and interpolated in unrolled loops, and L its layout. Texel
+// i is centred at i / w as with nearest sampling.
+struct NearestFilter
 {
-	float u = vec.x * 6.;
-	int n = (int)u;
-	u = (u - n) * 2. - 1.;
-	float v = vec.y * 2. - 1.;
-	const vec3 faces[6] = {
-		vec3(1., -v, u),	// +X
-		vec3(-1., -v, -u),	// -X
-		vec3(-u, 1., v),	// +Y
-		vec3(-u, -1., -v),	// -Y
-		vec3(-u, -v, 1),	// +Z
-		vec3(u, -v, -1),	// -Z
-	};
-	return faces[n % 6];
-}
+	template <int N, class L = RowLayout, class T>
+	static inline void sample(const Image *src, const vec2 &uv, T *p)
+	{
+		int x, y;
+		src->nearest(uv, &x, &y);
+		memcpy(p, (const T *)src->ptr + L::at(src, x, y) * N, sizeof(T) * N);
+	}
+};
 
-static inline vec2 cubemap_uvToLatLong(const vec2 &vec, int face)
+struct BilinearFilter
 {
-	return euclideanToLatLong(cubemap_uvToEuclidean(vec, face));
-}
+	template <int N, class L = RowLayout, class T>
+	static inline void sample(const Image *src, const Image::Coord &c, T *p)
+	{
+		typedef Component<T> C;
+		const int w = src->w, n = N;
+		int x0 = c.x >> 8, y0 = c.y >> 8, fx = c.x & 0xff, fy = c.y & 0xff;
+		int x1 = x0 + 1 != w ? x0 + 1 : 0, y1 = y0 + 1 != src->h ? y0 + 1 : y0;
+		const T *sp = (const T *)src->ptr;
+		const T *p00 = sp + L::at(src, x0, y0) * n, *p10 = sp + L::at(src, x1, y0) * n;
+		const T *p01 = sp + L::at(src, x0, y1) * n, *p11 = sp + L::at(src, x1, y1) * n;
+		for (int k = 0; k != n; k++) {
+			typename C::Value t = C::lerp(C::get(p00[k]), C::get(p10[k]), fx);
+			typename C::Value b = C::lerp(C::get(p01[k]), C::get(p11[k]), fx);
+			p[k] = C::put(C::lerp(t, b, fy));
+		}
+	}
+	template <int N, class L = RowLayout, class T>
+	static inline void sample(const Image *src, const vec2 &uv, T *p)
+	{
+		sample<N, L>(src, src->coord(uv), p);
+	}
+};
 
-static inline vec2 cubemap_uvToLatLong(const vec2 &vec)
+// Catmull-Rom
+struct BicubicFilter
 {
-	return euclideanToLatLong(cubemap_uvToEuclidean(vec));
-}
-/* }}} */
+	static inline void weights(float t, float *k)
+	{
+		k[0] = ((-0.5f * t + 1.f) * t - 0.5f) * t;
+		k[1] = (1.5f * t - 2.5f) * t * t + 1.f;
+		k[2] = ((-1.5f * t + 2.f) * t + 0.5f) * t;
+		k[3] = (0.5f * t - 0.5f) * t * t;
+	}
+
+	template <int N, class L = RowLayout, class T>
+	static inline void sample(const Image *src, const Image::Coord &c, T *p)
+	{
+		typedef Component<T> C;
+		const int w = src->w, h = src->h, n = N;
+		int x = c.x >> 8, y = c.y >> 8;
+		float kx[4], ky[4];
+		weights((c.x & 0xff) / 256.f, kx);
+		weights((c.y & 0xff) / 256.f, ky);
+		int xs[4] = {x != 0 ? x - 1 : w - 1, x, x + 1 != w ? x + 1 : 0, 0};
+		xs[3] = xs[2] + 1 != w ? xs[2] + 1 : 0;
+		float acc[4] = {0.f, 0.f, 0.f, 0.f};
+		for (int j = 0; j != 4; j++) {
+			int yj = y + j - 1;
+			yj = yj < 0 ? 0 : yj < h ? yj : h - 1;
+			for (int i = 0; i != 4; i++) {
+				const T *r = (const T *)src->ptr + L::at(src, xs[i], yj) * n;
+				for (int k = 0; k != n; k++)
+					acc[k] += ky[j] * kx[i] * C::get(r[k]);
+			}
+		}
+		for (int k = 0; k != n; k++)
+			p[k] = C::round(acc[k]);
+	}
+	template <int N, class L = RowLayout, class T>
+	static inline void sample(const Image *src, const vec2 &uv, T *p)
+	{
+		sample<N, L>(src, src->coord(uv), p);
+	}
+};
+
+// Integer sampling of 8-bit sources stored in rows, N components per
+// texel. uv are scaled once to 16.16 fixed point texel coordinates, 64-bit
+// so that any width fits, then wrapped with a mask for power of two widths
+// or a conditional add and subtract otherwise, which needs uv.x in
+// [-1, 2) as with all mappings. There is no floorf, roundf, division or
+// modulo per sample, and the source is copied so that its fields are not
+// reloaded after every store of the target.
+template <int N>
+struct FixedSampler
+{
+	explicit FixedSampler(const Image *src) :
+		ptr((const uint8_t *)src->ptr), w(src->w), h(src->h), sx(src->w * 65536.f),
+		sy(src->h * 65536.f), period((int64_t)src->w << 16), ymax((int64_t)(src->h - 1) << 16),
+		pow2((src->w & (src->w - 1)) == 0) {}
 
-static void (*const targetSize)(Image *img, int *w, int *h)
-	= cubemap_targetSize;
+	inline int64_t x(float u) const
+	{
+		int64_t x = lrintf(u * sx);
+		if (pow2)
+			return x & (period - 1);
+		x += x < 0 ? period : 0;
+		return x - (x >= period ? period : 0);
+	}
+
+	inline void nearest(const vec2 &uv, uint8_t *p) const
+	{
+		int u = (x(uv.x) + 0x8000) >> 16, v = (lrintf(uv.y * sy) + 0x8000) >> 16;
+		u = u != w ? u : 0;
+		v = v < 0 ? 0 : v < h ? v : h - 1;
+		memcpy(p, ptr + ((size_t)v * w + u) * N, N);
+	}
 
-// Source texture transformation
-static vec2 (*const latLongToUV)(const vec2 &vec)
-	= latLong_latLongToUV;
+	// Weights are rounded to the 8 fraction bits Component::lerp expects
+	inline void bilinear(const vec2 &uv, uint8_t *p) const
+	{
+		typedef Component<uint8_t> C;
+		int64_t cx = x(uv.x), cy = lrintf(uv.y * sy);
+		cy = cy < 0 ? 0 : cy < ymax ? cy : ymax;
+		int ix = (cx + 0x80) >> 8, iy = (cy + 0x80) >> 8;
+		int x0 = ix >> 8, y0 = iy >> 8, fx = ix & 0xff, fy = iy & 0xff;
+		x0 = x0 != w ? x0 : 0;
+		int x1 = x0 + 1 != w ? x0 + 1 : 0, y1 = y0 + 1 != h ? y0 + 1 : y0;
+		const uint8_t *r0 = ptr + (size_t)y0 * w * N, *r1 = ptr + (size_t)y1 * w * N;
+		for (int k = 0; k != N; k++) {
+			int t = C::lerp(r0[x0 * N + k], r0[x1 * N + k], fx);
+			int b = C::lerp(r1[x0 * N + k], r1[x1 * N + k], fx);
+			p[k] = C::lerp(t, b, fy);
+		}
+	}
 
-// Target texture transformation
-static vec2 (*const uvToLatLong)(const vec2 &vec)
-	= cubemap_uvToLatLong;
+	const uint8_t *ptr;
+	int w, h;
+	float sx, sy;
+	int64_t period, ymax;
+	bool pow2;
+};
 /* }}} */
 
-/* {{{ Rendering */
-static inline void generic_rendering(const Image *src, Image *dst)
+/* {{{ Transformations */
+static inline vec2 euclideanToLatLong(const vec3 &vec)
 {
-	uint8_t *ptr = (uint8_t *)dst->ptr;
-	for (int v = 0; v != dst->h; v++)
-		for (int u = 0; u != dst->w; u++) {
-			vec2 dstUV(((float)u + 0.5) / (float)dst->w, ((float)v + 0.5) / (float)dst->h);
-			memcpy(ptr, src->uv(latLongToUV(uvToLatLong(dstUV))), src->n);
-			ptr += 3;
-		}
+	return vec2(atan2f(vec.z, vec.x), acosf(vec.normalized().dot(vec3(0., 1., 0.))));
 }
 
-static inline void cubemap_rendering(const Image *src, Image *dst)
+// Inverse trigonometry of the mappings, maxError is the largest absolute
+// error in radians over the whole domain
+struct ExactMath
 {
-	const int s = dst->h, w = dst->w, n = dst->n;
-	uint8_t *line = (uint8_t *)dst->ptr;
-	for (int v = 0; v != s; v++) {
-		uint8_t *ptr = line;
-		for (int u = 0; u != s; u++) {
-			vec2 dstUV(((float)u + 0.5) / (float)s, ((float)v + 0.5) / (float)s);
-#if 0
-			for (int f = 0; f != 6; f++)
-				memcpy(ptr + (u + f * s) * n, src->uv(latLongToUV(cubemap_uvToLatLong(dstUV, f))), src->n);
-#else
-			memcpy(ptr + s * n * 0, src->uv(latLongToUV(cubemap_uvToLatLong(dstUV, 0))), src->n);
-			memcpy(ptr + s * n * 1, src->uv(latLongToUV(cubemap_uvToLatLong(dstUV, 1))), src->n);
-			memcpy(ptr + s * n * 2, src->uv(latLongToUV(cubemap_uvToLatLong(dstUV, 2))), src->n);
-			memcpy(ptr + s * n * 3, src->uv(latLongToUV(cubemap_uvToLatLong(dstUV, 3))), src->n);
-			memcpy(ptr + s * n * 4, src->uv(latLongToUV(cubemap_uvToLatLong(dstUV, 4))), src->n);
-			memcpy(ptr + s * n * 5, src->uv(latLongToUV(cubemap_uvToLatLong(dstUV, 5))), src->n);
-			ptr += n;
-#endif
-		}
-		line += w * n;
+	static constexpr float maxError = 0.;
+	static inline float acos(float x) { return acosf(x); }
+	static inline float atan2(float y, float x) { return atan2f(y, x); }
+};
+
+// Polynomial approximations, Abramowitz and Stegun 4.4.45 for acos and a
+// degree 9 odd minimax polynomial for atan on [0, 1] with octant
+// reduction. Measured errors are 6.8e-5 and 1.2e-5 radians
+struct FastMath
+{
+	static constexpr float maxError = 7e-5;
+
+	static inline float acos(float x)
+	{
+		float a = fabsf(x);
+		float r = sqrtf(1.f - a) * (((-0.0187293f * a + 0.0742610f) * a - 0.2121144f) * a + 1.5707288f);
+		return x < 0.f ? (float)M_PI - r : r;
 	}
-}
 
-// Target specific rendering loop
-static void (*const rendering)(const Image *src, Image *dst)
-	= cubemap_rendering;
-/* }}} */
+	static inline float atan2(float y, float x)
+	{
+		float ax = fabsf(x), ay = fabsf(y);
+		float mx = std::max(ax, ay);
+		float a = mx > 0.f ? std::min(ax, ay) / mx : 0.f, z = a * a;
+		float r = a * (0.9998660f + z * (-0.3302995f + z * (0.1801410f + z * (-0.0851330f + z * 0.0208351f))));
+		if (ay > ax)
+			r = (float)(M_PI / 2.) - r;
+		if (x < 0.f)
+			r = (float)M_PI - r;
+		return y < 0.f ? -r : r;
+	}
+};
 
-/* {{{ main */
-static void help()
+// Rotation of the source: the target direction at longitude 0 on the
+// equator, the centre of the +X face, sees the source at longitude yaw
+// and elevation pitch, turned by roll about that direction. Angles are in
+// degrees, the matrix maps target directions to source directions.
+struct Orientation
 {
-	fputs("conv INPUT OUTPUT\n", stderr);
-}
+	Orientation() : yaw(0.), pitch(0.), roll(0.) {}
+	Orientation(float yaw, float pitch, float roll) : yaw(yaw), pitch(pitch), roll(roll)
+	{
+		const float k = M_PI / 180.;
+		float cy = cosf(yaw * k), sy = sinf(yaw * k), cp = cosf(pitch * k), sp = sinf(pitch * k);
+		float cr = cosf(roll * k), sr = sinf(roll * k);
+		// Yaw about +Y towards +Z, pitch about +Z towards +Y, roll about +X
+		mat3 y(vec3(cy, 0., -sy), vec3(0., 1., 0.), vec3(sy, 0., cy));
+		mat3 p(vec3(cp, -sp, 0.), vec3(sp, cp, 0.), vec3(0., 0., 1.));
+		mat3 r(vec3(1., 0., 0.), vec3(0., cr, -sr), vec3(0., sr, cr));
+		m = y * p * r;
+	}
 
-int main(int argc, char *argv[])
+	bool identity() const { return yaw == 0. && pitch == 0. && roll == 0.; }
+	// Rotation back, keeping the angles only to tell it from the identity
+	Orientation inverse() const
+	{
+		Orientation o = *this;
+		o.yaw = -yaw;
+		o.pitch = -pitch;
+		o.roll = -roll;
+		o.m = m.transposed();
+		return o;
+	}
+
+	float yaw, pitch, roll;
+	mat3 m;
+};
+
+// Projections are structs of static members, used as template arguments
+// so that every source and target pair gets its own inlined kernels:
+//   faces        Number of square faces laid out left to right as target,
+//                or 1 for a single face covering the whole image
+//   centre       Texel u of a target face s texels wide is centred at
+//                (u + centre) / s
+//   targetSize   Target dimensions for a source image and a size option,
+//                0 keeping the source pixel count
+//   accepts      Whether an image has valid dimensions as source
+//   latLongToUV  Source uv at longitude and latitude, with texel i of the
+//                source centred at i / w as Image sampling expects
+//   uvToLatLong  Longitude and latitude at uv of a target face
+//   euclideanToUV, uvToEuclidean
+//                The same for directions, +Y being latitude 0 and
+//                longitude increasing from +X towards +Z
+
+/* {{{ LatLong transformations */
+struct LatLong
 {
-	if (argc != 3) {
-		help();
-		return 1;
+	static const int faces = 1;
+	// Texels centred at u / w as with source sampling, making the
+	// identity conversion exact
+	static constexpr float centre = 0.;
+
+	// Size is the height
+	static void targetSize(const Image *img, int size, int *w, int *h)
+	{
+		float x = sqrtf((float)(img->w * img->h) / 2.);
+		*h = size ? size : roundf(x);
+		*w = *h * 2;
 	}
 
-	struct timeval tStart, tEnd, tElapsed;
+	static bool accepts(const Image *) { return true; }
 
-	puts(ESC_YELLOW "Loading input image..." ESC_DEFAULT);
-	Image src, dst;
-	gettimeofday(&tStart, NULL);
-	if (!src.load(argv[1])) {
-		fputs(ESC_RED "Error loading input image\n" ESC_DEFAULT, stderr);
-		return 2;
+	static inline vec2 latLongToUV(const vec2 &vec, const Image *)
+	{
+		return vec2(vec.x / 2. / M_PI, vec.y / M_PI);
 	}
-	gettimeofday(&tEnd, NULL);
-	timersub(&tEnd, &tStart, &tElapsed);
-	printf(ESC_CYAN "Time elapsed: %ld.%06ld\n" ESC_DEFAULT, tElapsed.tv_sec, tElapsed.tv_usec);
 
-	dst.n = src.n;
-	targetSize(&src, &dst.w, &dst.h);
-	if (!dst.alloc()) {
-		fputs(ESC_RED "Error allocating image memory\n" ESC_DEFAULT, stderr);
-		stbi_image_free(src.ptr);
-		return 4;
+	static inline vec2 uvToLatLong(const vec2 &vec, int)
+	{
+		return vec2(vec.x * 2. * M_PI, vec.y * M_PI);
 	}
-	printf(ESC_BLUE "Output image size: %ux%u\n" ESC_DEFAULT, dst.w, dst.h);
 
-	puts(ESC_YELLOW "Rendering..." ESC_DEFAULT);
-	gettimeofday(&tStart, NULL);
-	rendering(&src, &dst);
-	gettimeofday(&tEnd, NULL);
-	timersub(&tEnd, &tStart, &tElapsed);
-	puts(ESC_GREEN "Rendering finished." ESC_DEFAULT);
-	printf(ESC_CYAN "Time elapsed: %ld.%06ld\n" ESC_DEFAULT, tElapsed.tv_sec, tElapsed.tv_usec);
+	static inline vec2 euclideanToUV(const vec3 &vec, const Image *img)
+	{
+		return latLongToUV(euclideanToLatLong(vec), img);
+	}
 
-	puts(ESC_YELLOW "Saving output image..." ESC_DEFAULT);
-	gettimeofday(&tStart, NULL);
-	//stbi_write_png(argv[2], dst.w, dst.h, dst.n, dst.ptr, dst.w * dst.n);
-	stbi_write_bmp(argv[2], dst.w, dst.h, dst.n, dst.ptr);
-	gettimeofday(&tEnd, NULL);
-	timersub(&tEnd, &tStart, &tElapsed);
-	printf(ESC_CYAN "Time elapsed: %ld.%06ld\n" ESC_DEFAULT, tElapsed.tv_sec, tElapsed.tv_usec);
+	static inline vec3 uvToEuclidean(const vec2 &vec, int face)
+	{
+		vec2 l = uvToLatLong(vec, face);
+		float r = sinf(l.y);
+		return vec3(r * cosf(l.x), cosf(l.y), r * sinf(l.x));
+	}
+};
+/* }}} */
 
-	stbi_image_free(src.ptr);
-	free(dst.ptr);
-	return 0;
+/* {{{ Cubemap transformations */
+// Face coordinates in [-1, 1] of cube maps: toCube takes the stored
+// coordinate to the tangent plane of the face, fromCube back
+struct LinearWarp
+{
+	static inline float toCube(float q) { return q; }
+	static inline float fromCube(float c) { return c; }
+};
+
+// Equi-angular cubemap, stored coordinates linear in the angle from the
+// face centre, so that texels cover closer solid angles across a face
+struct EquiAngularWarp
+{
+	static inline float toCube(float q) { return tanf(q * (float)(M_PI / 4.)); }
+	static inline float fromCube(float c) { return atanf(c) * (float)(4. / M_PI); }
+};
+
+// Horizontal strip of the +X, -X, +Y, -Y, +Z and -Z faces
+template <class Warp>
+struct CubeFaces
+{
+	static const int faces = 6;
+	static constexpr float centre = 0.5;
+
+	// Size is the face size
+	static void targetSize(const Image *img, int size, int *w, int *h)
+	{
+		float x = sqrtf((float)(img->w * img->h) / 6.);
+		*h = size ? size : roundf(x);
+		*w = *h * 6;
+	}
+
+	static inline vec3 uvToEuclidean(const vec2 &vec, const unsigned int face)
+	{
+		float u = Warp::toCube(vec.x * 2. - 1.);
+		float v = Warp::toCube(vec.y * 2. - 1.);
+		switch (face) {
+		case 0:		// +X
+			return vec3(1., -v, u);
+		case 1:		// -X
+			return vec3(-1., -v, -u);
+		case 2:		// +Y
+			return vec3(-u, 1., v);
+		case 3:		// -Y
+			return vec3(-u, -1., -v);
+		case 4:		// +Z
+			return vec3(-u, -v, 1);
+		default:	// -Z
+			return vec3(u, -v, -1);
+		};
+	}
+
+	static inline vec2 uvToLatLong(const vec2 &vec, int face)
+	{
+		return euclideanToLatLong(uvToEuclidean(vec, face));
+	}
+
+	static bool accepts(const Image *img) { return img->w == img->h * 6; }
+
+	// Source uv of a direction, the face being picked by its major axis
+	// with selects rather than branches. Texels are clamped to the face
+	// so that filters do not blend in a neighbouring face.
+	static inline vec2 euclideanToUV(const vec3 &vec, const Image *img)
+	{
+		const int s = img->h;
+		float ax = fabsf(vec.x), ay = fabsf(vec.y), az = fabsf(vec.z);
+		bool isX = ax >= ay && ax >= az, isY = !isX && ay >= az;
+		float sx = copysignf(1., vec.x), sy = copysignf(1., vec.y), sz = copysignf(1., vec.z);
+		float ma = isX ? ax : isY ? ay : az;
+		float u = isX ? vec.z * sx : isY ? -vec.x : -vec.x * sz;
+		float v = isX ? -vec.y : isY ? vec.z * sy : -vec.y;
+		int face = isX ? vec.x < 0 : isY ? 2 + (vec.y < 0) : 4 + (vec.z < 0);
+		u = (Warp::fromCube(u / ma) + 1.f) * 0.5f * s - 0.5f;
+		v = (Warp::fromCube(v / ma) + 1.f) * 0.5f * s - 0.5f;
+		u = u > 0.f ? u < s - 1 ? u : s - 1 : 0.f;
+		v = v > 0.f ? v < s - 1 ? v : s - 1 : 0.f;
+		return vec2((face * s + u) / img->w, v / s);
+	}
+
+	static inline vec2 latLongToUV(const vec2 &vec, const Image *img)
+	{
+		float r = sinf(vec.y);
+		return euclideanToUV(vec3(r * cosf(vec.x), cosf(vec.y), r * sinf(vec.x)), img);
+	}
+};
+
+typedef CubeFaces<LinearWarp> Cubemap;
+typedef CubeFaces<EquiAngularWarp> Eac;
+/* }}} */
+/* }}} */
+
+/* {{{ Rendering */
+// Output rows per task handed to the thread pool
+static const int renderBand = 16;
+
+// Mappings walk target rows [v0, v1), calling op(i, uv) for every
+// target texel index i with the source uv it samples
+
+// Exact per face transformations
+template <class Source, class Target>
+struct ReferenceMapping
+{
+	template <class Op>
+	static inline void map(const Image *src, const Image *dst, int v0, int v1, Op op)
+	{
+		const int s = dst->w / Target::faces, h = dst->h;
+		const FaceLayout l = dst->faces(Target::faces);
+		for (int v = v0; v != v1; v++)
+			for (int u = 0; u != s; u++) {
+				vec2 dstUV(((float)u + Target::centre) / (float)s, ((float)v + Target::centre) / (float)h);
+				for (int f = 0; f != Target::faces; f++)
+					op(l.at(f, u, v), Source::latLongToUV(Target::uvToLatLong(dstUV, f), src));
+			}
+	}
+};
+
+// Reference mapping of target directions rotated by an orientation,
+// which breaks the symmetries the other mappings rely on
+template <class Source, class Target>
+struct RotatedMapping
+{
+	explicit RotatedMapping(const mat3 &m) : m(m) {}
+
+	template <class Op>
+	inline void map(const Image *src, const Image *dst, int v0, int v1, Op op) const
+	{
+		const int s = dst->w / Target::faces, h = dst->h;
+		const FaceLayout l = dst->faces(Target::faces);
+		for (int v = v0; v != v1; v++)
+			for (int u = 0; u != s; u++) {
+				vec2 dstUV(((float)u + Target::centre) / (float)s, ((float)v + Target::centre) / (float)h);
+				for (int f = 0; f != Target::faces; f++)
+					op(l.at(f, u, v), Source::euclideanToUV(m * Target::uvToEuclidean(dstUV, f), src));
+			}
+	}
+
+	mat3 m;
+};
+
+// Cube symmetry with a latlong source: the side faces share latitude and
+// their longitudes are quarter turns apart, with the side longitude only
+// depending on the column; +Y and -Y are reflections of each other.
+// That leaves one sqrtf, two acosf and one atan2f per texel for 6 faces.
+// Warp gives the face coordinates of the cube layout, see CubeFaces.
+template <class Math = ExactMath, class Warp = LinearWarp>
+struct SymmetricMapping
+{
+	// Side face longitude of every column
+	static inline void longitudes(float *lon, int s)
+	{
+		for (int u = 0; u != s; u++)
+			lon[u] = Math::atan2(Warp::toCube(((float)u + 0.5) / (float)s * 2. - 1.), 1.) / 2. / M_PI;
+	}
+
+	// Side latitude, +Y latitude and +Y longitude in uv units at face
+	// coordinates (x, y)
+	static inline void angles(float x, float y, float a[3])
+	{
+		float l = sqrtf(1. + x * x + y * y);
+		a[0] = Math::acos(-y / l) / M_PI;
+		a[1] = Math::acos(1. / l) / M_PI;
+		a[2] = Math::atan2(y, -x) / 2. / M_PI;
+	}
+
+	// Source uv of all faces from the side longitude and angles
+	static inline void faces(float lon, const float a[3], vec2 uv[6])
+	{
+		uv[0] = vec2(lon, a[0]);
+		uv[1] = vec2(lon + 0.5, a[0]);
+		uv[2] = vec2(a[2], a[1]);
+		uv[3] = vec2(-a[2], 1. - a[1]);
+		uv[4] = vec2(lon + 0.25, a[0]);
+		uv[5] = vec2(lon - 0.25, a[0]);
+	}
+
+	// Source uv of all faces at face coordinates (x, y)
+	static inline void texel(float lon, float x, float y, vec2 uv[6])
+	{
+		float a[3];
+		angles(x, y, a);
+		faces(lon, a, uv);
+	}
+
+	template <class Op>
+	static inline void map(const Image *src, const Image *dst, int v0, int v1, Op op)
+	{
+		const int s = dst->h;
+		const FaceLayout l = dst->faces(6);
+		std::vector<float> lon(s), x(s);
+		longitudes(lon.data(), s);
+		for (int u = 0; u != s; u++)
+			x[u] = Warp::toCube(((float)u + 0.5) / (float)s * 2. - 1.);
+		for (int v = v0; v != v1; v++) {
+			ptrdiff_t i[6];
+			for (int f = 0; f != 6; f++)
+				i[f] = l.at(f, 0, v);
+			float y = Warp::toCube(((float)v + 0.5) / (float)s * 2. - 1.);
+			for (int u = 0; u != s; u++) {
+				vec2 uv[6];
+				texel(lon[u], x[u], y, uv);
+				for (int f = 0; f != 6; f++) {
+					op(i[f], uv[f]);
+					i[f] += l.du[f];
+				}
+			}
+		}
+	}
+};
+
+// Symmetric mapping with the angles fitted along rows, where they are
+// smooth functions of the column: spans of up to 32 texels take the
+// quadratic through their exact ends and middle, checked against exact
+// values at the quarters and halved until within tolerance, down to 4
+// texels evaluated exactly. Smooth rows need 4 exact evaluations per 32
+// texels
+struct IncrementalMapping
+{
+	typedef SymmetricMapping<> Symmetric;
+	static constexpr int span = 32;
+	// Fit tolerance in radians at the quarters, and the largest direction
+	// error measured beyond that of the exact angles, 2.1e-5 radians over
+	// faces of 16 to 12289 texels
+	static constexpr float tolerance = 2e-5, maxError = 2.5e-5;
+
+	static inline float coord(int u, int s) { return ((float)u + 0.5) / (float)s * 2. - 1.; }
+
+	// Angles of texels [u0, u0 + m) of the row at y into a, m <= n, from
+	// exact angles at u0, u0 + n / 2 and u0 + n
+	static void fit(int u0, int n, int m, int s, float y, const float tol[3],
+			const float f0[3], const float fm[3], const float f1[3], float *a)
+	{
+		float q1[3], q3[3];
+		Symmetric::angles(coord(u0 + n / 4, s), y, q1);
+		Symmetric::angles(coord(u0 + n * 3 / 4, s), y, q3);
+		if (n == 4) {
+			const float *f[4] = {f0, q1, fm, q3};
+			for (int k = 0; k != m; k++)
+				for (int j = 0; j != 3; j++)
+					a[k * 3 + j] = f[k][j];
+			return;
+		}
+
+		// p(k) = f0 + k * (b + k * c) through k = 0, n / 2 and n
+		float b[3], c[3];
+		bool ok = true;
+		for (int j = 0; j != 3; j++) {
+			c[j] = 2.f * (f1[j] - 2.f * fm[j] + f0[j]) / (float)(n * n);
+			b[j] = (f1[j] - f0[j]) / (float)n - c[j] * n;
+			float k1 = n / 4, k3 = n * 3 / 4;
+			ok = ok && fabsf(f0[j] + k1 * (b[j] + k1 * c[j]) - q1[j]) <= tol[j] &&
+				fabsf(f0[j] + k3 * (b[j] + k3 * c[j]) - q3[j]) <= tol[j];
+		}
+		if (ok) {
+			for (int k = 0; k != m; k++)
+				for (int j = 0; j != 3; j++)
+					a[k * 3 + j] = f0[j] + k * (b[j] + k * c[j]);
+			return;
+		}
+		fit(u0, n / 2, std::min(m, n / 2), s, y, tol, f0, q1, fm, a);
+		if (m > n / 2)
+			fit(u0 + n / 2, n / 2, m - n / 2, s, y, tol, fm, q3, f1, a + n / 2 * 3);
+	}
+
+	template <class Op>
+	static inline void map(const Image *src, const Image *dst, int v0, int v1, Op op)
+	{
+		const int s = dst->h;
+		const FaceLayout l = dst->faces(6);
+		// Latitudes are in half turns, longitudes in turns
+		const float tol[3] = {tolerance / (float)M_PI, tolerance / (float)M_PI, tolerance / 2.f / (float)M_PI};
+		std::vector<float> lon(s), a((size_t)s * 3);
+		Symmetric::longitudes(lon.data(), s);
+		for (int v = v0; v != v1; v++) {
+			float y = coord(v, s);
+			float f0[3], fm[3], f1[3];
+			Symmetric::angles(coord(0, s), y, f1);
+			for (int u0 = 0; u0 < s; u0 += span) {
+				int m = std::min(span, s - u0), n = span;
+				while (n > 4 && n / 2 >= m)
+					n /= 2;
+				memcpy(f0, f1, sizeof(f0));
+				Symmetric::angles(coord(u0 + n / 2, s), y, fm);
+				Symmetric::angles(coord(u0 + n, s), y, f1);
+				fit(u0, n, m, s, y, tol, f0, fm, f1, &a[(size_t)u0 * 3]);
+			}
+
+			ptrdiff_t i[6];
+			for (int f = 0; f != 6; f++)
+				i[f] = l.at(f, 0, v);
+			for (int u = 0; u != s; u++) {
+				vec2 uv[6];
+				Symmetric::faces(lon[u], &a[(size_t)u * 3], uv);
+				for (int f = 0; f != 6; f++) {
+					op(i[f], uv[f]);
+					i[f] += l.du[f];
+				}
+			}
+		}
+	}
+};
+
+// Latlong target from a cubemap source: the direction of a texel is the
+// product of row and column factors, so trigonometry is only evaluated
+// once per row and column, and the face selection is branchless
+template <class Cube = Cubemap>
+struct SeparableMapping
+{
+	template <class Op>
+	static inline void map(const Image *src, const Image *dst, int v0, int v1, Op op)
+	{
+		const int w = dst->w, h = dst->h;
+		std::vector<float> cs(w * 2);
+		for (int u = 0; u != w; u++) {
+			float lon = LatLong::uvToLatLong(vec2((float)u / (float)w, 0.), 0).x;
+			cs[u * 2] = cosf(lon);
+			cs[u * 2 + 1] = sinf(lon);
+		}
+		for (int v = v0; v != v1; v++) {
+			size_t i = (size_t)v * w;
+			float lat = LatLong::uvToLatLong(vec2(0., (float)v / (float)h), 0).y;
+			float r = sinf(lat), y = cosf(lat);
+			for (int u = 0; u != w; u++, i++)
+				op(i, Cube::euclideanToUV(vec3(r * cs[u * 2], y, r * cs[u * 2 + 1]), src));
+		}
+	}
+};
+
+template <class Mapping, class Sampler, class T, int N>
+static inline void mapping_rendering(const Mapping &m, const Image *src, Image *dst, int v0, int v1)
+{
+	T *dp = (T *)dst->ptr;
+	m.map(src, dst, v0, v1, [=](size_t i, const vec2 &uv) {
+		Sampler::template sample<N>(src, uv, dp + i * N);
+	});
+}
+
+// Target of the source texel type
+template <class Mapping>
+static void mapping_rendering(const Mapping &m, const Image *src, Image *dst, Filter filter, int v0, int v1)
+{
+	with_texel(src, [=](auto t, auto n) {
+		typedef decltype(t) T;
+		constexpr int N = decltype(n)::value;
+		switch (filter) {
+		case FilterNearest:
+			mapping_rendering<Mapping, NearestFilter, T, N>(m, src, dst, v0, v1);
+			break;
+		case FilterBilinear:
+			mapping_rendering<Mapping, BilinearFilter, T, N>(m, src, dst, v0, v1);
+			break;
+		default:
+			mapping_rendering<Mapping, BicubicFilter, T, N>(m, src, dst, v0, v1);
+			break;
+		}
+	});
+}
+
+template <class Mapping>
+static void mapping_rendering(const Image *src, Image *dst, Filter filter, int v0, int v1)
+{
+	mapping_rendering(Mapping(), src, dst, filter, v0, v1);
+}
+
+// Target of an 8-bit source through FixedSampler
+template <class Mapping, int N>
+static inline void fixed_rendering(const Image *src, Image *dst, Filter filter, int v0, int v1)
+{
+	const FixedSampler<N> s(src);
+	uint8_t *dp = (uint8_t *)dst->ptr;
+	if (filter == FilterNearest)
+		Mapping::map(src, dst, v0, v1, [=](size_t i, const vec2 &uv) { s.nearest(uv, dp + i * N); });
+	else
+		Mapping::map(src, dst, v0, v1, [=](size_t i, const vec2 &uv) { s.bilinear(uv, dp + i * N); });
+}
+
+// Sources and filters fixed_rendering samples with FixedSampler
+static bool fixed_native(const Image *src, Filter filter)
+{
+	return src->type == TypeU8 && filter != FilterBicubic;
+}
+
+// Integer sampling for nearest and bilinear filtering of 8-bit sources,
+// other types and filters taking the float samplers
+template <class Mapping>
+static void fixed_rendering(const Image *src, Image *dst, Filter filter, int v0, int v1)
+{
+	if (!fixed_native(src, filter)) {
+		mapping_rendering<Mapping>(src, dst, filter, v0, v1);
+		return;
+	}
+	switch (src->n) {
+	case 1:
+		fixed_rendering<Mapping, 1>(src, dst, filter, v0, v1);
+		break;
+	case 4:
+		fixed_rendering<Mapping, 4>(src, dst, filter, v0, v1);
+		break;
+	default:
+		fixed_rendering<Mapping, 3>(src, dst, filter, v0, v1);
+		break;
+	}
+}
+
+// Lookup table entries are source texel indices for nearest sampling,
+// fixed point texel coordinates otherwise, in the order of the faces in
+// a strip whatever the layout of the target
+template <class Mapping>
+static void mapping_indexing(const Mapping &m, const Image *src, const Image *dst, Filter filter, void *lut,
+			     int v0, int v1)
+{
+	Image strip = *dst;
+	strip.layout = 0;
+	dst = &strip;
+	if (filter == FilterNearest) {
+		uint32_t *idx = (uint32_t *)lut;
+		m.map(src, dst, v0, v1, [=](size_t i, const vec2 &uv) {
+			idx[i] = src->index(uv);
+		});
+	} else {
+		Image::Coord *c = (Image::Coord *)lut;
+		m.map(src, dst, v0, v1, [=](size_t i, const vec2 &uv) {
+			c[i] = src->coord(uv);
+		});
+	}
+}
+
+template <class Mapping>
+static void mapping_indexing(const Image *src, const Image *dst, Filter filter, void *lut, int v0, int v1)
+{
+	mapping_indexing(Mapping(), src, dst, filter, lut, v0, v1);
+}
+
+// Reference rendering and lookup table construction with the target
+// directions rotated by m, see Orientation
+template <class Source, class Target>
+static void rotated_rendering(const Image *src, Image *dst, Filter filter, const mat3 &m, int v0, int v1)
+{
+	mapping_rendering(RotatedMapping<Source, Target>(m), src, dst, filter, v0, v1);
+}
+
+template <class Source, class Target>
+static void rotated_indexing(const Image *src, const Image *dst, Filter filter, const mat3 &m, void *lut,
+			     int v0, int v1)
+{
+	mapping_indexing(RotatedMapping<Source, Target>(m), src, dst, filter, lut, v0, v1);
+}
+
+// Gather target face rows [i, e) through a lookup table into texels
+// step apart from dp
+template <class T, int N>
+static inline void lut_rendering(const Image *src, Filter filter, const void *lut, size_t i, size_t e,
+				 T *dp, ptrdiff_t step)
+{
+	const int n = N;
+	const T *sp = (const T *)src->ptr;
+	const uint32_t *idx = (const uint32_t *)lut;
+	const Image::Coord *c = (const Image::Coord *)lut;
+	step *= n;
+	switch (filter) {
+	case FilterNearest:
+		for (; i != e; i++, dp += step)
+			memcpy(dp, sp + (size_t)idx[i] * n, sizeof(T) * n);
+		break;
+	case FilterBilinear:
+		for (; i != e; i++, dp += step)
+			BilinearFilter::sample<N>(src, c[i], dp);
+		break;
+	default:
+		for (; i != e; i++, dp += step)
+			BicubicFilter::sample<N>(src, c[i], dp);
+		break;
+	}
+}
+
+// Gather target rows [v0, v1) through a lookup table, no transformations.
+// Entries are in strip order, see mapping_indexing, and are written
+// along face rows to wherever the layout of the target stores them
+template <class T, int N>
+static void lut_rendering(const Image *src, Image *dst, Filter filter, const void *lut, int v0, int v1)
+{
+	T *dp = (T *)dst->ptr;
+	if (!dst->layout) {
+		lut_rendering<T, N>(src, filter, lut, (size_t)v0 * dst->w, (size_t)v1 * dst->w, dp + (size_t)v0 * dst->w * N, 1);
+		return;
+	}
+	const FaceLayout *l = dst->layout;
+	for (int v = v0; v != v1; v++)
+		for (int f = 0; f != l->faces; f++) {
+			size_t i = (size_t)v * dst->w + (size_t)f * l->s;
+			lut_rendering<T, N>(src, filter, lut, i, i + l->s, dp + l->at(f, 0, v) * N, l->du[f]);
+		}
+}
+
+static void lut_rendering(const Image *src, Image *dst, Filter filter, const void *lut, int v0, int v1)
+{
+	with_texel(src, [=](auto t, auto n) {
+		lut_rendering<decltype(t), decltype(n)::value>(src, dst, filter, lut, v0, v1);
+	});
+}
+
+// Target rows [v0, v1) of a latlong source turned by a whole number of
+// texels in longitude, the source rows shifted left by shift in [0, w)
+// with two copies per row. Every filter samples texel centres exactly.
+static void shift_rendering(const Image *src, Image *dst, int shift, int v0, int v1)
+{
+	const size_t texel = src->texel(), row = src->w * texel, head = shift * texel;
+	for (int v = v0; v != v1; v++) {
+		const uint8_t *sp = (const uint8_t *)src->ptr + v * row;
+		uint8_t *dp = (uint8_t *)dst->ptr + v * row;
+		memcpy(dp, sp + head, row - head);
+		memcpy(dp + row - head, sp, head);
+	}
+}
+
+// Square block of a target face, streamed conversion renders them in the
+// order of the source rows [lo, hi] they read
+struct Tile
+{
+	int face, u0, v0, u1, v1;
+	int lo, hi;
+};
+
+// Source rows read by a filter sampling uv
+static inline void filter_rows(const Image *src, Filter filter, const vec2 &uv, int *lo, int *hi)
+{
+	int y0, y1;
+	if (filter == FilterNearest) {
+		y0 = y1 = src->index(uv) / src->w;
+	} else {
+		y0 = src->coord(uv).y >> 8;
+		y1 = y0 + 1 != src->h ? y0 + 1 : y0;
+		if (filter == FilterBicubic) {
+			y0 = y0 != 0 ? y0 - 1 : 0;
+			y1 = y1 + 1 != src->h ? y1 + 1 : y1;
+		}
+	}
+	*lo = y0 < *lo ? y0 : *lo;
+	*hi = y1 > *hi ? y1 : *hi;
+}
+
+// Tile texels with the source uv they sample, as ReferenceMapping
+template <class Source, class Target, class Op>
+static inline void tile_map(const Image *src, const Image *dst, const Tile &t, Op op)
+{
+	const int s = dst->w / Target::faces, h = dst->h;
+	for (int v = t.v0; v != t.v1; v++)
+		for (int u = t.u0; u != t.u1; u++) {
+			vec2 dstUV(((float)u + Target::centre) / (float)s, ((float)v + Target::centre) / (float)h);
+			op(u - t.u0, v - t.v0, Source::latLongToUV(Target::uvToLatLong(dstUV, t.face), src));
+		}
+}
+
+// Set the source rows of a tile, src only needs its dimensions
+template <class Source, class Target>
+static void tile_rows(const Image *src, const Image *dst, Filter filter, Tile *t)
+{
+	int lo = src->h, hi = -1;
+	tile_map<Source, Target>(src, dst, *t, [&](int, int, const vec2 &uv) {
+		filter_rows(src, filter, uv, &lo, &hi);
+	});
+	t->lo = lo;
+	t->hi = hi;
+}
+
+template <class Source, class Target, class Sampler, class L, class T, int N>
+static inline void tile_rendering(const Image *src, const Image *dst, const Tile &t, uint8_t *out, ptrdiff_t stride)
+{
+	tile_map<Source, Target>(src, dst, t, [=](int u, int v, const vec2 &uv) {
+		Sampler::template sample<N, L>(src, uv, (T *)(out + v * stride) + u * N);
+	});
+}
+
+template <class Source, class Target, class L, class T, int N>
+static void tile_rendering(const Image *src, const Image *dst, Filter filter, const Tile &t,
+			   uint8_t *out, ptrdiff_t stride)
+{
+	switch (filter) {
+	case FilterNearest:
+		tile_rendering<Source, Target, NearestFilter, L, T, N>(src, dst, t, out, stride);
+		break;
+	case FilterBilinear:
+		tile_rendering<Source, Target, BilinearFilter, L, T, N>(src, dst, t, out, stride);
+		break;
+	default:
+		tile_rendering<Source, Target, BicubicFilter, L, T, N>(src, dst, t, out, stride);
+		break;
+	}
+}
+
+// Render a tile to out, rows being stride bytes apart, in the source
+// texel type. Only the source rows of the tile have to be present.
+template <class Source, class Target>
+static void tile_rendering(const Image *src, const Image *dst, Filter filter, const Tile &t,
+			   uint8_t *out, ptrdiff_t stride)
+{
+	with_texel(src, [=](auto c, auto n) {
+		typedef decltype(c) T;
+		constexpr int N = decltype(n)::value;
+		if (src->tile)
+			tile_rendering<Source, Target, TiledLayout, T, N>(src, dst, filter, t, out, stride);
+		else
+			tile_rendering<Source, Target, RowLayout, T, N>(src, dst, filter, t, out, stride);
+	});
+}
+
+// Target traversal orders. Rows renders bands of rows with the kernel,
+// which visits all faces of a texel in turn; the others render one face
+// at a time, in bands of rows or in square tiles taken row by row or
+// along a Morton or Hilbert curve, so that consecutive texels sample
+// nearby source texels.
+enum Order {OrderRows, OrderFaces, OrderTiles, OrderMorton, OrderHilbert, OrderCount};
+static const char *const orderNames[OrderCount] = {"rows", "face", "tiled", "morton", "hilbert"};
+// Tile size of the tiled orders
+static const int orderTile = 32;
+
+static inline uint32_t morton(uint32_t x, uint32_t y)
+{
+	uint32_t d = 0;
+	for (int b = 0; b != 16; b++)
+		d |= (x >> b & 1) << 2 * b | (y >> b & 1) << (2 * b + 1);
+	return d;
+}
+
+// Distance of (x, y) along the Hilbert curve of a square n wide, n being
+// a power of 2
+static inline uint32_t hilbert(uint32_t n, uint32_t x, uint32_t y)
+{
+	uint32_t d = 0;
+	for (uint32_t s = n / 2; s; s /= 2) {
+		uint32_t rx = (x & s) != 0, ry = (y & s) != 0;
+		d += s * s * ((3 * rx) ^ ry);
+		if (!ry) {
+			if (rx) {
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+// Tiles of a target of faces faces s texels wide and h high, in order
+static void order_tiles(Order order, int faces, int s, int h, std::vector<Tile> *tiles)
+{
+	const int size = order == OrderFaces ? renderBand : orderTile, wide = order == OrderFaces ? s : size;
+	uint32_t n = 1;
+	while (n * size < (uint32_t)std::max(s, h))
+		n *= 2;
+	std::vector<std::pair<uint64_t, Tile> > keyed;
+	for (int face = 0; face != faces; face++)
+		for (int v = 0; v < h; v += size)
+			for (int u = 0; u < s; u += wide) {
+				uint32_t x = u / size, y = v / size;
+				uint32_t d = order == OrderMorton ? morton(x, y) : order == OrderHilbert ? hilbert(n, x, y) : y * n + x;
+				keyed.push_back(std::make_pair((uint64_t)face << 32 | d,
+							       Tile{face, u, v, std::min(u + wide, s), std::min(v + size, h), 0, 0}));
+			}
+	std::sort(keyed.begin(), keyed.end(), [](const std::pair<uint64_t, Tile> &a, const std::pair<uint64_t, Tile> &b) {
+		return a.first < b.first;
+	});
+	tiles->clear();
+	for (const std::pair<uint64_t, Tile> &k: keyed)
+		tiles->push_back(k.second);
+}
+
+// Split the target into row bands and process them on the thread pool
+static void parallel_rows(ThreadPool *pool, int h, const std::function<void(int v0, int v1)> &func)
+{
+	pool->run((h + renderBand - 1) / renderBand, [&](int task) {
+		int v0 = task * renderBand;
+		func(v0, v0 + renderBand < h ? v0 + renderBand : h);
+	});
+}
+
+// Convert rows [v0, v1) of src to the component type and channels of dst,
+// keeping full intensity and clamping integers. Grey is replicated to
+// RGB, missing alpha is opaque and extra channels are dropped.
+template <class S, class D>
+static void convert_rows(const Image *src, Image *dst, int v0, int v1)
+{
+	const float k = Component<D>::scale / Component<S>::scale;
+	const int sn = src->n, dn = dst->n;
+	const S *sp = (const S *)src->ptr + (size_t)v0 * src->w * sn;
+	D *dp = (D *)dst->ptr + (size_t)v0 * dst->w * dn;
+	if (sn == dn) {
+		for (size_t i = 0, e = (size_t)(v1 - v0) * src->w * sn; i != e; i++)
+			dp[i] = Component<D>::round(Component<S>::get(sp[i]) * k);
+		return;
+	}
+	const D opaque = Component<D>::round(Component<D>::scale);
+	for (size_t i = 0, e = (size_t)(v1 - v0) * src->w; i != e; i++, sp += sn, dp += dn)
+		for (int c = 0; c != dn; c++) {
+			int j = sn == 1 && c < 3 ? 0 : c;
+			dp[c] = j < sn ? Component<D>::round(Component<S>::get(sp[j]) * k) : opaque;
+		}
+}
+
+static void convert_rows(const Image *src, Image *dst, int v0, int v1)
+{
+	with_component(src->type, [=](auto s) {
+		with_component(dst->type, [=](auto d) {
+			convert_rows<decltype(s), decltype(d)>(src, dst, v0, v1);
+		});
+	});
+}
+
+// Allocate dst as src converted to type and n channels, on the pool if
+// given
+static bool convert_image(ThreadPool *pool, const Image *src, Image *dst, Type type, int n)
+{
+	*dst = *src;
+	dst->type = type;
+	dst->n = n;
+	if (!dst->alloc())
+		return false;
+	if (pool)
+		parallel_rows(pool, src->h, [=](int v0, int v1) { convert_rows(src, dst, v0, v1); });
+	else
+		convert_rows(src, dst, 0, src->h);
+	return true;
+}
+
+// Source tile size of --tiled-source as a power of 2, 16 texels wide
+static const int sourceTile = 4;
+
+// Allocate dst as src stored in square tiles 1 << tile wide, on the pool
+// if given
+static bool tile_image(ThreadPool *pool, const Image *src, Image *dst, int tile)
+{
+	*dst = *src;
+	dst->tile = tile;
+	if (!dst->alloc())
+		return false;
+	const size_t texel = src->texel();
+	const int side = 1 << tile;
+	auto rows = [=](int v0, int v1) {
+		for (int v = v0; v != v1; v++)
+			for (int u = 0; u < src->w; u += side)
+				memcpy((uint8_t *)dst->ptr + TiledLayout::at(dst, u, v) * texel,
+				       (const uint8_t *)src->ptr + ((size_t)v * src->w + u) * texel,
+				       std::min(side, src->w - u) * texel);
+	};
+	if (pool)
+		parallel_rows(pool, src->h, rows);
+	else
+		rows(0, src->h);
+	return true;
+}
+/* }}} */
+
+/* {{{ Area filtering */
+// Source mip pyramid, level 0 is the source itself and every further
+// level halves both dimensions with a 2x2 box, wrapping in longitude
+struct Mipmap
+{
+	~Mipmap() { release(); }
+
+	bool build(ThreadPool *pool, const Image *src);
+	void release();
+
+	std::vector<Image> levels;
+
+private:
+	template <class T, int N>
+	static void downsample(const Image *src, Image *dst, int v0, int v1);
+};
+
+template <class T, int N>
+void Mipmap::downsample(const Image *src, Image *dst, int v0, int v1)
+{
+	typedef Component<T> C;
+	const int w = src->w, n = N;
+	T *p = (T *)dst->ptr + (size_t)v0 * dst->w * n;
+	for (int v = v0; v != v1; v++) {
+		const T *r0 = (const T *)src->ptr + (size_t)v * 2 * w * n;
+		const T *r1 = v * 2 + 1 != src->h ? r0 + (size_t)w * n : r0;
+		for (int u = 0; u != dst->w; u++) {
+			int x0 = u * 2 * n, x1 = u * 2 + 1 != w ? x0 + n : 0;
+			for (int k = 0; k != n; k++)
+				*p++ = C::put(C::box(C::get(r0[x0 + k]), C::get(r0[x1 + k]),
+						     C::get(r1[x0 + k]), C::get(r1[x1 + k])));
+		}
+	}
+}
+
+bool Mipmap::build(ThreadPool *pool, const Image *src)
+{
+	// Level buffers are reused while the source dimensions do not change
+	if (levels.empty() || levels[0].w != src->w || levels[0].h != src->h || levels[0].n != src->n ||
+	    levels[0].type != src->type) {
+		release();
+		levels.push_back(*src);
+		for (int w = src->w, h = src->h; w != 1 || h != 1;) {
+			Image l = Image();
+			l.w = w = (w + 1) / 2;
+			l.h = h = (h + 1) / 2;
+			l.n = src->n;
+			l.type = src->type;
+			if (!l.alloc()) {
+				release();
+				return false;
+			}
+			levels.push_back(l);
+		}
+	}
+	levels[0] = *src;
+	for (size_t i = 1; i != levels.size(); i++) {
+		const Image *a = &levels[i - 1];
+		Image *b = &levels[i];
+		parallel_rows(pool, b->h, [=](int v0, int v1) {
+			with_texel(a, [=](auto t, auto n) {
+				downsample<decltype(t), decltype(n)::value>(a, b, v0, v1);
+			});
+		});
+	}
+	return true;
+}
+
+void Mipmap::release()
+{
+	for (size_t i = 1; i < levels.size(); i++)
+		free(levels[i].ptr);
+	levels.clear();
+}
+
+// Integrates the source over the footprint of a target texel, given by
+// the source uv offsets du and dv across the texel. The footprint is
+// approximated by up to maxAniso trilinear taps along its major axis,
+// with the mip level matching its minor axis.
+struct AreaFilter
+{
+	static const int maxAniso = 16;
+
+	// Add weight times the bilinear sample of level l at uv to acc. With a
+	// single source face it wraps in longitude, otherwise it is clamped to
+	// the given face.
+	template <int N, class T>
+	static inline void tap(const Image *img, int l, int faces, int face, const vec2 &uv, float weight, float *acc)
+	{
+		typedef Component<T> C;
+		const int w = img->w, h = img->h, n = N;
+		// Level texel i covers source texels i << l to ((i + 1) << l) - 1
+		float o = 0.5f / (1 << l) - 0.5f;
+		float x = uv.x * w + o, y = uv.y * h + o;
+		int x0, x1, y0, y1;
+		if (faces == 1) {
+			x -= floorf(x / w) * w;
+			x0 = (int)x;
+			x0 = x0 < w ? x0 : 0;
+			x1 = x0 + 1 != w ? x0 + 1 : 0;
+		} else {
+			const int lo = face * (w / faces), hi = lo + w / faces - 1;
+			x = x > lo ? x < hi ? x : hi : lo;
+			x0 = (int)x;
+			x1 = x0 != hi ? x0 + 1 : x0;
+		}
+		y = y < 0.f ? 0.f : y < h - 1 ? y : h - 1;
+		y0 = (int)y;
+		y1 = y0 + 1 != h ? y0 + 1 : y0;
+		float fx = x - x0, fy = y - y0;
+		const T *r0 = (const T *)img->ptr + (size_t)y0 * w * n;
+		const T *r1 = (const T *)img->ptr + (size_t)y1 * w * n;
+		float k00 = (1.f - fx) * (1.f - fy) * weight, k10 = fx * (1.f - fy) * weight;
+		float k01 = (1.f - fx) * fy * weight, k11 = fx * fy * weight;
+		for (int k = 0; k != n; k++)
+			acc[k] += C::get(r0[x0 * n + k]) * k00 + C::get(r0[x1 * n + k]) * k10 +
+				C::get(r1[x0 * n + k]) * k01 + C::get(r1[x1 * n + k]) * k11;
+	}
+
+	// Source with faces laid out left to right
+	template <int N, class T>
+	static inline void sample(const Mipmap *mip, int faces, const vec2 &uv, const vec2 &du, const vec2 &dv,
+				  T *p)
+	{
+		const Image *src = &mip->levels[0];
+		const int levels = mip->levels.size(), n = N;
+		int face = Image::warp(uv.x) * faces;
+		face = face < faces ? face : faces - 1;
+		// Footprint axes in source texels, the minor axis is the width of
+		// the parallelogram they span as both are nearly parallel at the
+		// latlong poles
+		float ax = du.x * src->w, ay = du.y * src->h, bx = dv.x * src->w, by = dv.y * src->h;
+		float a = hypotf(ax, ay), b = hypotf(bx, by);
+		vec2 axis = a > b ? du : dv;
+		float major = a > b ? a : b;
+		float minor = major > 0.f ? fabsf(ax * by - ay * bx) / major : 0.f;
+		float width = minor > major / maxAniso ? minor : major / maxAniso;
+		// Rounding slack so that an exact single texel footprint takes one tap
+		int taps = ceilf(major / (width > 1.f ? width : 1.f) - 1e-3f);
+		taps = taps < 1 ? 1 : taps < maxAniso ? taps : maxAniso;
+		float lod = width > 1.f ? log2f(width) : 0.f;
+		int l = (int)lod;
+		float t = lod - l;
+		if (l >= levels - 1) {
+			l = levels - 1;
+			t = 0.f;
+		}
+
+		float acc[4] = {0.f, 0.f, 0.f, 0.f};
+		for (int i = 0; i != taps; i++) {
+			float o = ((float)i + 0.5f) / taps - 0.5f;
+			vec2 c(uv.x + axis.x * o, uv.y + axis.y * o);
+			tap<N, T>(&mip->levels[l], l, faces, face, c, (1.f - t) / taps, acc);
+			if (t > 0.f)
+				tap<N, T>(&mip->levels[l + 1], l + 1, faces, face, c, t / taps, acc);
+		}
+		for (int k = 0; k != n; k++)
+			p[k] = Component<T>::round(acc[k]);
+	}
+};
+
+// Source uv difference b - a, the shorter way around in longitude
+static inline vec2 uvDelta(const vec2 &a, const vec2 &b)
+{
+	float x = b.x - a.x;
+	return vec2(x - floorf(x + 0.5f), b.y - a.y);
+}
+
+// Source uv difference across a texel from its centre c and the opposite
+// edges a and b. Central unless one side jumps over a source face
+// boundary, then the other side is used alone.
+static inline vec2 uvFootprint(const vec2 &a, const vec2 &c, const vec2 &b)
+{
+	vec2 da = uvDelta(a, c), db = uvDelta(c, b);
+	float la = da.x * da.x + da.y * da.y, lb = db.x * db.x + db.y * db.y;
+	if (la > lb * 16.f)
+		return vec2(db.x * 2.f, db.y * 2.f);
+	if (lb > la * 16.f)
+		return vec2(da.x * 2.f, da.y * 2.f);
+	return vec2(da.x + db.x, da.y + db.y);
+}
+
+// Render target rows [v0, v1) with the area filter, the footprint is
+// taken from differences of the exact per face transformation
+template <class Source, class Target, class T, int N>
+static void area_rendering(const Mipmap *mip, Image *dst, int v0, int v1)
+{
+	const Image *src = &mip->levels[0];
+	const int s = dst->w / Target::faces, h = dst->h, n = N;
+	const float dx = 0.5f / s, dy = 0.5f / h;
+	const FaceLayout l = dst->faces(Target::faces);
+	for (int v = v0; v != v1; v++)
+		for (int f = 0; f != Target::faces; f++) {
+			T *ptr = (T *)dst->ptr + l.at(f, 0, v) * n;
+			for (int u = 0; u != s; u++) {
+				auto at = [=](float x, float y) {
+					return Source::latLongToUV(Target::uvToLatLong(vec2(x, y), f), src);
+				};
+				float x = ((float)u + Target::centre) / (float)s, y = ((float)v + Target::centre) / (float)h;
+				vec2 c = at(x, y);
+				vec2 du = uvFootprint(at(x - dx, y), c, at(x + dx, y));
+				vec2 dv = uvFootprint(at(x, y - dy), c, at(x, y + dy));
+				AreaFilter::sample<N>(mip, Source::faces, c, du, dv, ptr);
+				ptr += l.du[f] * n;
+			}
+		}
+}
+
+template <class Source, class Target>
+static void area_rendering(const Mipmap *mip, Image *dst, int v0, int v1)
+{
+	with_texel(&mip->levels[0], [=](auto t, auto n) {
+		area_rendering<Source, Target, decltype(t), decltype(n)::value>(mip, dst, v0, v1);
+	});
+}
+/* }}} */
+
+/* {{{ SIMD kernels */
+#if defined(__x86_64__) || defined(__i386__)
+// The vector wrappers below are only ever inlined into entry points
+// compiled for the matching target, but the generic kernel templates are
+// also compiled for the default target before being inlined. Vectors are
+// passed to and from the templates by reference, and the remaining ABI
+// warnings about the wrappers' return values are disabled for the rest of
+// the file, where instantiations are diagnosed.
+#pragma GCC diagnostic ignored "-Wpsabi"
+#define AVX2_TARGET	__attribute__((target("avx2,fma")))
+#define AVX512_TARGET	__attribute__((target("avx512f,avx512bw,avx2,fma")))
+
+// 8 lanes
+struct Avx2
+{
+	typedef __m256 F;
+	typedef __m256i I;
+	typedef __m256 M;
+	static const int lanes = 8;
+
+	static bool supported() { return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"); }
+
+	AVX2_TARGET static inline F set1(float v) { return _mm256_set1_ps(v); }
+	AVX2_TARGET static inline F ramp() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+	AVX2_TARGET static inline F load(const float *p) { return _mm256_loadu_ps(p); }
+	AVX2_TARGET static inline F add(F a, F b) { return _mm256_add_ps(a, b); }
+	AVX2_TARGET static inline F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+	AVX2_TARGET static inline F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+	AVX2_TARGET static inline F div(F a, F b) { return _mm256_div_ps(a, b); }
+	// a * b + c
+	AVX2_TARGET static inline F fmadd(F a, F b, F c) { return _mm256_fmadd_ps(a, b, c); }
+	AVX2_TARGET static inline F sqrt(F a) { return _mm256_sqrt_ps(a); }
+	AVX2_TARGET static inline F abs(F a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+	AVX2_TARGET static inline F neg(F a) { return _mm256_xor_ps(_mm256_set1_ps(-0.f), a); }
+	AVX2_TARGET static inline F min(F a, F b) { return _mm256_min_ps(a, b); }
+	AVX2_TARGET static inline F max(F a, F b) { return _mm256_max_ps(a, b); }
+	AVX2_TARGET static inline F floor(F a) { return _mm256_floor_ps(a); }
+	AVX2_TARGET static inline M gt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+	// Sign bit set, including -0
+	AVX2_TARGET static inline M signbit(F a) { return a; }
+	// m ? a : b
+	AVX2_TARGET static inline F select(M m, F a, F b) { return _mm256_blendv_ps(b, a, m); }
+
+	AVX2_TARGET static inline void store(float *p, F a) { _mm256_storeu_ps(p, a); }
+	// Interleave r, g and b into 8 RGB texels
+	AVX2_TARGET static inline void store3f(float *p, F r, F g, F b)
+	{
+		const I i0 = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+		const I i1 = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+		const I i2 = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+		_mm256_storeu_ps(p, _mm256_blend_ps(_mm256_blend_ps(_mm256_permutevar8x32_ps(r, i0),
+			_mm256_permutevar8x32_ps(g, i0), 0x92), _mm256_permutevar8x32_ps(b, i0), 0x24));
+		_mm256_storeu_ps(p + 8, _mm256_blend_ps(_mm256_blend_ps(_mm256_permutevar8x32_ps(r, i1),
+			_mm256_permutevar8x32_ps(g, i1), 0x24), _mm256_permutevar8x32_ps(b, i1), 0x49));
+		_mm256_storeu_ps(p + 16, _mm256_blend_ps(_mm256_blend_ps(_mm256_permutevar8x32_ps(r, i2),
+			_mm256_permutevar8x32_ps(g, i2), 0x49), _mm256_permutevar8x32_ps(b, i2), 0x92));
+	}
+	// Floats from base + byte offsets
+	AVX2_TARGET static inline F gatherf(const void *base, I offset) { return _mm256_i32gather_ps((const float *)base, offset, 1); }
+
+	AVX2_TARGET static inline I set1i(int v) { return _mm256_set1_epi32(v); }
+	// Round to nearest
+	AVX2_TARGET static inline I cvt(F a) { return _mm256_cvtps_epi32(a); }
+	AVX2_TARGET static inline F cvtf(I a) { return _mm256_cvtepi32_ps(a); }
+	AVX2_TARGET static inline I addi(I a, I b) { return _mm256_add_epi32(a, b); }
+	AVX2_TARGET static inline I subi(I a, I b) { return _mm256_sub_epi32(a, b); }
+	AVX2_TARGET static inline I mulli(I a, I b) { return _mm256_mullo_epi32(a, b); }
+	AVX2_TARGET static inline I minu(I a, I b) { return _mm256_min_epu32(a, b); }
+	AVX2_TARGET static inline I mini(I a, I b) { return _mm256_min_epi32(a, b); }
+	AVX2_TARGET static inline I maxi(I a, I b) { return _mm256_max_epi32(a, b); }
+	AVX2_TARGET static inline I andi(I a, I b) { return _mm256_and_si256(a, b); }
+	AVX2_TARGET static inline I ori(I a, I b) { return _mm256_or_si256(a, b); }
+	template <int N> AVX2_TARGET static inline I srli(I a) { return _mm256_srli_epi32(a, N); }
+	template <int N> AVX2_TARGET static inline I slli(I a) { return _mm256_slli_epi32(a, N); }
+	// 16-bit lanes
+	AVX2_TARGET static inline I add16(I a, I b) { return _mm256_add_epi16(a, b); }
+	AVX2_TARGET static inline I sub16(I a, I b) { return _mm256_sub_epi16(a, b); }
+	AVX2_TARGET static inline I mullo16(I a, I b) { return _mm256_mullo_epi16(a, b); }
+	template <int N> AVX2_TARGET static inline I srli16(I a) { return _mm256_srli_epi16(a, N); }
+	template <int N> AVX2_TARGET static inline I slli16(I a) { return _mm256_slli_epi16(a, N); }
+	AVX2_TARGET static inline void storei(void *p, I a) { _mm256_storeu_si256((I *)p, a); }
+	// 32-bit loads from base + byte offsets
+	AVX2_TARGET static inline I gather(const void *base, I offset) { return _mm256_i32gather_epi32((const int *)base, offset, 1); }
+	// Store the low 3 bytes of every lane
+	AVX2_TARGET static inline void store3(void *p, I a)
+	{
+		const I shuf = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+						0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+		a = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(a, shuf), _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+		_mm256_maskstore_epi32((int *)p, _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0), a);
+	}
+};
+
+// 16 lanes
+struct Avx512
+{
+	typedef __m512 F;
+	typedef __m512i I;
+	typedef __mmask16 M;
+	static const int lanes = 16;
+
+	static bool supported() { return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"); }
+
+	AVX512_TARGET static inline F set1(float v) { return _mm512_set1_ps(v); }
+	AVX512_TARGET static inline F ramp() { return _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15); }
+	AVX512_TARGET static inline F load(const float *p) { return _mm512_loadu_ps(p); }
+	AVX512_TARGET static inline F add(F a, F b) { return _mm512_add_ps(a, b); }
+	AVX512_TARGET static inline F sub(F a, F b) { return _mm512_sub_ps(a, b); }
+	AVX512_TARGET static inline F mul(F a, F b) { return _mm512_mul_ps(a, b); }
+	AVX512_TARGET static inline F div(F a, F b) { return _mm512_div_ps(a, b); }
+	AVX512_TARGET static inline F fmadd(F a, F b, F c) { return _mm512_fmadd_ps(a, b, c); }
+	AVX512_TARGET static inline F sqrt(F a) { return _mm512_sqrt_ps(a); }
+	AVX512_TARGET static inline F abs(F a) { return _mm512_abs_ps(a); }
+	AVX512_TARGET static inline F neg(F a) { return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_set1_epi32(INT32_MIN))); }
+	AVX512_TARGET static inline F min(F a, F b) { return _mm512_min_ps(a, b); }
+	AVX512_TARGET static inline F max(F a, F b) { return _mm512_max_ps(a, b); }
+	AVX512_TARGET static inline F floor(F a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+	AVX512_TARGET static inline M gt(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+	AVX512_TARGET static inline M signbit(F a) { return _mm512_test_epi32_mask(_mm512_castps_si512(a), _mm512_set1_epi32(INT32_MIN)); }
+	AVX512_TARGET static inline F select(M m, F a, F b) { return _mm512_mask_blend_ps(m, b, a); }
+
+	AVX512_TARGET static inline void store(float *p, F a) { _mm512_storeu_ps(p, a); }
+	AVX512_TARGET static inline void store3f(float *p, F r, F g, F b)
+	{
+		const I i0 = _mm512_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+		const I i1 = _mm512_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+		const I i2 = _mm512_setr_epi32(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+		F v = _mm512_permutexvar_ps(i0, r);
+		v = _mm512_mask_permutexvar_ps(v, 0x2492, i0, g);
+		_mm512_storeu_ps(p, _mm512_mask_permutexvar_ps(v, 0x4924, i0, b));
+		v = _mm512_permutexvar_ps(i1, r);
+		v = _mm512_mask_permutexvar_ps(v, 0x9249, i1, g);
+		_mm512_storeu_ps(p + 16, _mm512_mask_permutexvar_ps(v, 0x2492, i1, b));
+		v = _mm512_permutexvar_ps(i2, r);
+		v = _mm512_mask_permutexvar_ps(v, 0x4924, i2, g);
+		_mm512_storeu_ps(p + 32, _mm512_mask_permutexvar_ps(v, 0x9249, i2, b));
+	}
+	AVX512_TARGET static inline F gatherf(const void *base, I offset) { return _mm512_i32gather_ps(offset, base, 1); }
+
+	AVX512_TARGET static inline I set1i(int v) { return _mm512_set1_epi32(v); }
+	AVX512_TARGET static inline I cvt(F a) { return _mm512_cvtps_epi32(a); }
+	AVX512_TARGET static inline F cvtf(I a) { return _mm512_cvtepi32_ps(a); }
+	AVX512_TARGET static inline I addi(I a, I b) { return _mm512_add_epi32(a, b); }
+	AVX512_TARGET static inline I subi(I a, I b) { return _mm512_sub_epi32(a, b); }
+	AVX512_TARGET static inline I mulli(I a, I b) { return _mm512_mullo_epi32(a, b); }
+	AVX512_TARGET static inline I minu(I a, I b) { return _mm512_min_epu32(a, b); }
+	AVX512_TARGET static inline I mini(I a, I b) { return _mm512_min_epi32(a, b); }
+	AVX512_TARGET static inline I maxi(I a, I b) { return _mm512_max_epi32(a, b); }
+	AVX512_TARGET static inline I andi(I a, I b) { return _mm512_and_si512(a, b); }
+	AVX512_TARGET static inline I ori(I a, I b) { return _mm512_or_si512(a, b); }
+	template <int N> AVX512_TARGET static inline I srli(I a) { return _mm512_srli_epi32(a, N); }
+	template <int N> AVX512_TARGET static inline I slli(I a) { return _mm512_slli_epi32(a, N); }
+	AVX512_TARGET static inline I add16(I a, I b) { return _mm512_add_epi16(a, b); }
+	AVX512_TARGET static inline I sub16(I a, I b) { return _mm512_sub_epi16(a, b); }
+	AVX512_TARGET static inline I mullo16(I a, I b) { return _mm512_mullo_epi16(a, b); }
+	template <int N> AVX512_TARGET static inline I srli16(I a) { return _mm512_srli_epi16(a, N); }
+	template <int N> AVX512_TARGET static inline I slli16(I a) { return _mm512_slli_epi16(a, N); }
+	AVX512_TARGET static inline void storei(void *p, I a) { _mm512_storeu_si512(p, a); }
+	AVX512_TARGET static inline I gather(const void *base, I offset) { return _mm512_i32gather_epi32(offset, base, 1); }
+	AVX512_TARGET static inline void store3(void *p, I a)
+	{
+		const I shuf = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+		const I perm = _mm512_setr_epi32(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 15, 15, 15, 15);
+		a = _mm512_permutexvar_epi32(perm, _mm512_shuffle_epi8(a, shuf));
+		_mm512_mask_storeu_epi32(p, 0x0fff, a);
+	}
+};
+
+// Polynomial approximations after Cephes asinf and atanf, within a few ulp.
+// Signed zeros are handled as in libm so that the pole texels match.
+// Measured errors are 3.0e-7 and 2.7e-7 radians, float acosf and atan2f
+// being 2.1e-7 and 2.5e-7
+static constexpr float simdMaxError = 3.1e-7;
+
+template <class V>
+__attribute__((always_inline)) static inline void simd_acos(typename V::F &res, const typename V::F &x)
+{
+	typedef typename V::F F;
+	F a = V::abs(x);
+	typename V::M big = V::gt(a, V::set1(0.5));
+	// acos(a) = 2 asin(sqrt((1 - a) / 2)) for a > 0.5, pi / 2 - asin(a) otherwise
+	F z = V::select(big, V::mul(V::sub(V::set1(1.), a), V::set1(0.5)), V::mul(a, a));
+	F t = V::select(big, V::sqrt(z), a);
+	F p = V::fmadd(V::set1(4.2163199048e-2), z, V::set1(2.4181311049e-2));
+	p = V::fmadd(p, z, V::set1(4.5470025998e-2));
+	p = V::fmadd(p, z, V::set1(7.4953002686e-2));
+	p = V::fmadd(p, z, V::set1(1.6666752422e-1));
+	p = V::fmadd(V::mul(p, z), t, t);
+	F r = V::select(big, V::add(p, p), V::sub(V::set1(M_PI / 2.), p));
+	res = V::select(V::signbit(x), V::sub(V::set1(M_PI), r), r);
+}
+
+template <class V>
+__attribute__((always_inline)) static inline void simd_atan2(typename V::F &res, const typename V::F &y, const typename V::F &x)
+{
+	typedef typename V::F F;
+	F ax = V::abs(x), ay = V::abs(y);
+	F mx = V::max(ax, ay);
+	// atan(a) for a = min / max in [0, 1], reduced to [0, tan(pi / 8)]
+	F a = V::select(V::gt(mx, V::set1(0.)), V::div(V::min(ax, ay), mx), V::set1(0.));
+	typename V::M big = V::gt(a, V::set1(0.4142135623730950));
+	F t = V::select(big, V::div(V::sub(a, V::set1(1.)), V::add(a, V::set1(1.))), a);
+	F z = V::mul(t, t);
+	F p = V::fmadd(V::set1(8.05374449538e-2), z, V::set1(-1.38776856032e-1));
+	p = V::fmadd(p, z, V::set1(1.99777106478e-1));
+	p = V::fmadd(p, z, V::set1(-3.33329491539e-1));
+	p = V::fmadd(V::mul(p, z), t, t);
+	F r = V::select(big, V::add(p, V::set1(M_PI / 4.)), p);
+	r = V::select(V::gt(ay, ax), V::sub(V::set1(M_PI / 2.), r), r);
+	r = V::select(V::signbit(x), V::sub(V::set1(M_PI), r), r);
+	res = V::select(V::signbit(y), V::neg(r), r);
+}
+
+// Source column along a row of size n, as Image::index
+template <class V>
+__attribute__((always_inline)) static inline void simd_texel(typename V::I &res, const typename V::F &t,
+							     const typename V::F &size, const typename V::I &n)
+{
+	typename V::I i = V::cvt(V::mul(V::sub(t, V::floor(t)), size));
+	res = V::minu(i, V::subi(i, n));
+}
+
+// Per byte a + (b - a) * f / 256 of packed texels, f in [0, 256] per lane,
+// rounded as BilinearFilter
+template <class V>
+__attribute__((always_inline)) static inline void simd_lerp(typename V::I &res, const typename V::I &a,
+							    const typename V::I &b, const typename V::I &f)
+{
+	typedef typename V::I I;
+	const I lo = V::set1i(0x00ff00ff), half = V::set1i(0x00800080);
+	I f2 = V::ori(f, V::template slli<16>(f));
+	I g2 = V::sub16(V::set1i(0x01000100), f2);
+	I even = V::add16(V::add16(V::mullo16(V::andi(a, lo), g2), V::mullo16(V::andi(b, lo), f2)), half);
+	I odd = V::add16(V::add16(V::mullo16(V::template srli16<8>(a), g2),
+				  V::mullo16(V::template srli16<8>(b), f2)), half);
+	res = V::ori(V::template srli16<8>(even), V::andi(odd, V::set1i(0xff00ff00)));
+}
+
+// Component k of float texels at byte offsets, one vector each
+template <class V>
+__attribute__((always_inline)) static inline void simd_gatherf(typename V::F *c, const void *base,
+							       const typename V::I &offset, int n)
+{
+	for (int k = 0; k != n; k++)
+		c[k] = V::gatherf(base, V::addi(offset, V::set1i(k * 4)));
+}
+
+// Interleave component vectors into V::lanes texels of n floats
+template <class V>
+__attribute__((always_inline)) static inline void simd_storef(float *p, const typename V::F *c, int n)
+{
+	if (n == 3) {
+		V::store3f(p, c[0], c[1], c[2]);
+		return;
+	}
+	float t[4][V::lanes];
+	for (int k = 0; k != n; k++)
+		V::store(t[k], c[k]);
+	for (int l = 0; l != V::lanes; l++)
+		for (int k = 0; k != n; k++)
+			p[l * n + k] = t[k][l];
+}
+
+// a + (b - a) * f as Component<float>::lerp, f already divided by 256
+template <class V>
+__attribute__((always_inline)) static inline void simd_lerpf(typename V::F &res, const typename V::F &a,
+							     const typename V::F &b, const typename V::F &f)
+{
+	res = V::add(a, V::mul(V::sub(b, a), f));
+}
+
+enum SimdMode {SimdIndex, SimdNearest, SimdBilinear};
+
+// Symmetric mapping of target rows [v0, v1), V::lanes texels at a time,
+// or that of RotatedMapping if m is not null, with the inverse
+// trigonometry evaluated per face.
+// Rendering modes write texels of component type T sampled from the
+// source to dst through its face layout, SimdIndex writes nearest source
+// texel indices to out in strip order.
+// 8-bit and float RGB and RGBA texels are gathered and interpolated in
+// vectors, others are sampled lane by lane at the vector coordinates.
+template <class V, SimdMode Mode, class T, int N>
+__attribute__((always_inline)) static inline void simd_map(const Image *src, const Image *dst, const mat3 *m,
+							   void *out, int v0, int v1)
+{
+	typedef typename V::F F;
+	typedef typename V::I I;
+	const int s = dst->h, n = N, L = V::lanes;
+	const int se = s - s % L;
+	const FaceLayout fl = Mode == SimdIndex ? Image{dst->w, dst->h}.faces(6) : dst->faces(6);
+	const bool packed = sizeof(T) == 1 && (n == 3 || n == 4);
+	const bool floats = std::is_same<T, float>::value && (n == 3 || n == 4);
+	const I fn = V::set1i(n * sizeof(float));
+	const F f256 = V::set1(1.f / 256.f);
+	const uint8_t *sp = (const uint8_t *)src->ptr;
+	T *dp = (T *)out;
+	uint32_t *idx = (uint32_t *)out;
+	// Lanes of faces not stored left to right, scattered along face rows
+	alignas(64) T lane[V::lanes * 4];
+	std::vector<float> lon(s);
+	SymmetricMapping<>::longitudes(lon.data(), s);
+
+	const F sw = V::set1(src->w), sh = V::set1(src->h);
+	const F sw8 = V::set1(src->w * 256.f), sh8 = V::set1(src->h * 256.f);
+	const I iw = V::set1i(src->w), in = V::set1i(n);
+	const I ih1 = V::set1i(src->h - 1), ymax = V::set1i((src->h - 1) * 256), ff = V::set1i(0xff);
+	const F fs = V::set1(s), ramp = V::ramp();
+	for (int v = v0; v != v1; v++) {
+		ptrdiff_t row[6];
+		for (int f = 0; f != 6; f++)
+			row[f] = fl.at(f, 0, v);
+		float y = ((float)v + 0.5) / (float)s * 2. - 1.;
+		const F fy = V::set1(y), l2 = V::set1(1. + y * y);
+		// Rotated face directions d0 + x * dx, linear in the face coordinate
+		// x from the directions at x = 0 and x = 1
+		float d0[6][3], dx[6][3];
+		if (m)
+			for (int f = 0; f != 6; f++) {
+				vec3 a = *m * Cubemap::uvToEuclidean(vec2(0.5, ((float)v + 0.5) / (float)s), f);
+				vec3 b = *m * Cubemap::uvToEuclidean(vec2(1., ((float)v + 0.5) / (float)s), f);
+				const float ta[3] = {a.x, a.y, a.z}, tb[3] = {b.x - a.x, b.y - a.y, b.z - a.z};
+				memcpy(d0[f], ta, sizeof(ta));
+				memcpy(dx[f], tb, sizeof(tb));
+			}
+		int u = 0;
+		for (; u != se; u += L) {
+			F x = V::fmadd(V::div(V::add(V::set1(u + 0.5), ramp), fs), V::set1(2.), V::set1(-1.));
+			F fu[6], fv[6];
+			if (m) {
+				for (int f = 0; f != 6; f++) {
+					F px = V::fmadd(x, V::set1(dx[f][0]), V::set1(d0[f][0]));
+					F py = V::fmadd(x, V::set1(dx[f][1]), V::set1(d0[f][1]));
+					F pz = V::fmadd(x, V::set1(dx[f][2]), V::set1(d0[f][2]));
+					F rl = V::div(V::set1(1.), V::sqrt(V::fmadd(px, px, V::fmadd(py, py, V::mul(pz, pz)))));
+					simd_atan2<V>(fu[f], pz, px);
+					simd_acos<V>(fv[f], V::mul(py, rl));
+					fu[f] = V::mul(fu[f], V::set1(0.5 / M_PI));
+					fv[f] = V::mul(fv[f], V::set1(1. / M_PI));
+				}
+			} else {
+				F rl = V::div(V::set1(1.), V::sqrt(V::fmadd(x, x, l2)));
+				F side, pole, poleLon;
+				simd_acos<V>(side, V::mul(V::set1(-y), rl));
+				simd_acos<V>(pole, rl);
+				simd_atan2<V>(poleLon, fy, V::neg(x));
+				side = V::mul(side, V::set1(1. / M_PI));
+				pole = V::mul(pole, V::set1(1. / M_PI));
+				poleLon = V::mul(poleLon, V::set1(0.5 / M_PI));
+				F sideLon = V::load(&lon[u]);
+				fu[0] = sideLon;
+				fu[1] = V::add(sideLon, V::set1(0.5));
+				fu[2] = poleLon;
+				fu[3] = V::neg(poleLon);
+				fu[4] = V::add(sideLon, V::set1(0.25));
+				fu[5] = V::sub(sideLon, V::set1(0.25));
+				fv[0] = fv[1] = fv[4] = fv[5] = side;
+				fv[2] = pole;
+				fv[3] = V::sub(V::set1(1.), pole);
+			}
+
+			for (int f = 0; f != 6; f++) {
+				const ptrdiff_t du = fl.du[f];
+				const size_t k = row[f] + u * du;
+				T *o = du == 1 ? dp + k * n : lane;
+				// Breaks skip to the scatter once o is written
+				do {
+					I px;
+					if (Mode != SimdBilinear) {
+						// Rows as Image::index, clamped at the poles
+						I col, row = V::maxi(V::mini(V::cvt(V::mul(fv[f], sh)), ih1), V::set1i(0));
+						simd_texel<V>(col, fu[f], sw, iw);
+						I j = V::addi(V::mulli(row, iw), col);
+						if (Mode == SimdIndex) {
+							V::storei(idx + k, j);
+							break;
+						}
+						if (floats) {
+							F c[4];
+							simd_gatherf<V>(c, sp, V::mulli(j, fn), n);
+							simd_storef<V>((float *)o, c, n);
+							break;
+						}
+						if (!packed) {
+							uint32_t t[L];
+							V::storei(t, j);
+							for (int l = 0; l != L; l++)
+								memcpy(o + l * n, (const T *)sp + (size_t)t[l] * n, sizeof(T) * n);
+							break;
+						}
+						px = V::gather(sp, V::mulli(j, in));
+					} else {
+						// 24.8 fixed point coordinates as Image::coord
+						I cx = V::cvt(V::mul(V::sub(fu[f], V::floor(fu[f])), sw8));
+						I cy = V::maxi(V::mini(V::cvt(V::mul(fv[f], sh8)), ymax), V::set1i(0));
+						I x0 = V::template srli<8>(cx), y0 = V::template srli<8>(cy);
+						x0 = V::minu(x0, V::subi(x0, iw));
+						I x1 = V::addi(x0, V::set1i(1));
+						x1 = V::minu(x1, V::subi(x1, iw));
+						I y1 = V::mini(V::addi(y0, V::set1i(1)), ih1);
+						I r0 = V::mulli(y0, iw), r1 = V::mulli(y1, iw);
+						if (floats) {
+							F fx = V::mul(V::cvtf(V::andi(cx, ff)), f256);
+							F fy = V::mul(V::cvtf(V::andi(cy, ff)), f256);
+							F c00[4], c10[4], c01[4], c11[4], c[4];
+							simd_gatherf<V>(c00, sp, V::mulli(V::addi(r0, x0), fn), n);
+							simd_gatherf<V>(c10, sp, V::mulli(V::addi(r0, x1), fn), n);
+							simd_gatherf<V>(c01, sp, V::mulli(V::addi(r1, x0), fn), n);
+							simd_gatherf<V>(c11, sp, V::mulli(V::addi(r1, x1), fn), n);
+							for (int q = 0; q != n; q++) {
+								F top, bottom;
+								simd_lerpf<V>(top, c00[q], c10[q], fx);
+								simd_lerpf<V>(bottom, c01[q], c11[q], fx);
+								simd_lerpf<V>(c[q], top, bottom, fy);
+							}
+							simd_storef<V>((float *)o, c, n);
+							break;
+						}
+						if (!packed) {
+							int32_t tx[L], ty[L];
+							V::storei(tx, cx);
+							V::storei(ty, cy);
+							for (int l = 0; l != L; l++) {
+								Image::Coord c = {tx[l] < src->w * 256 ? tx[l] : 0, ty[l]};
+								BilinearFilter::sample<N>(src, c, o + l * n);
+							}
+							break;
+						}
+						I top, bottom;
+						simd_lerp<V>(top, V::gather(sp, V::mulli(V::addi(r0, x0), in)),
+							     V::gather(sp, V::mulli(V::addi(r0, x1), in)), V::andi(cx, ff));
+						simd_lerp<V>(bottom, V::gather(sp, V::mulli(V::addi(r1, x0), in)),
+							     V::gather(sp, V::mulli(V::addi(r1, x1), in)), V::andi(cx, ff));
+						simd_lerp<V>(px, top, bottom, V::andi(cy, ff));
+					}
+					if (n == 3)
+						V::store3(o, px);
+					else
+						V::storei(o, px);
+				} while (0);
+				if (Mode != SimdIndex && du != 1)
+					for (int l = 0; l != L; l++)
+						memcpy(dp + (k + l * du) * n, lane + l * n, sizeof(T) * n);
+			}
+		}
+		for (; u != s; u++) {
+			vec2 uv[6];
+			if (m)
+				for (int f = 0; f != 6; f++)
+					uv[f] = LatLong::euclideanToUV(*m * Cubemap::uvToEuclidean(
+						vec2(((float)u + 0.5) / (float)s, ((float)v + 0.5) / (float)s), f), src);
+			else
+				SymmetricMapping<>::texel(lon[u], ((float)u + 0.5) / (float)s * 2. - 1., y, uv);
+			for (int f = 0; f != 6; f++) {
+				size_t k = row[f] + u * fl.du[f];
+				if (Mode == SimdIndex)
+					idx[k] = src->index(uv[f]);
+				else if (Mode == SimdNearest)
+					NearestFilter::sample<N>(src, uv[f], dp + k * n);
+				else
+					BilinearFilter::sample<N>(src, uv[f], dp + k * n);
+			}
+		}
+	}
+}
+
+// Gathers use 32-bit byte offsets
+static inline bool simd_gatherable(const Image *src)
+{
+	return src->bytes() <= INT32_MAX;
+}
+
+template <class V, class T, int N>
+__attribute__((always_inline)) static inline void simd_rendering(const Image *src, Image *dst, Filter filter,
+								 const mat3 *m, int v0, int v1)
+{
+	if (filter == FilterNearest)
+		simd_map<V, SimdNearest, T, N>(src, dst, m, dst->ptr, v0, v1);
+	else
+		simd_map<V, SimdBilinear, T, N>(src, dst, m, dst->ptr, v0, v1);
+}
+
+template <class V, class T>
+__attribute__((always_inline)) static inline void simd_rendering(const Image *src, Image *dst, Filter filter,
+								 const mat3 *m, int v0, int v1)
+{
+	switch (src->n) {
+	case 1:
+		simd_rendering<V, T, 1>(src, dst, filter, m, v0, v1);
+		break;
+	case 4:
+		simd_rendering<V, T, 4>(src, dst, filter, m, v0, v1);
+		break;
+	default:
+		simd_rendering<V, T, 3>(src, dst, filter, m, v0, v1);
+		break;
+	}
+}
+
+// Not through with_texel, whose lambda would not be compiled for the
+// target of the calling kernel
+template <class V>
+__attribute__((always_inline)) static inline void simd_rendering(const Image *src, Image *dst, Filter filter,
+								 const mat3 *m, int v0, int v1)
+{
+	switch (src->type) {
+	case TypeU8:
+		simd_rendering<V, uint8_t>(src, dst, filter, m, v0, v1);
+		break;
+	case TypeU16:
+		simd_rendering<V, uint16_t>(src, dst, filter, m, v0, v1);
+		break;
+	case TypeHalf:
+		simd_rendering<V, half>(src, dst, filter, m, v0, v1);
+		break;
+	default:
+		simd_rendering<V, float>(src, dst, filter, m, v0, v1);
+		break;
+	}
+}
+
+// Sources and filters the SIMD kernels render in vectors, others take
+// the scalar symmetric mapping
+static bool simd_native(const Image *src, Filter filter)
+{
+	return simd_gatherable(src) && filter != FilterBicubic;
+}
+
+AVX2_TARGET static void avx2_rendering(const Image *src, Image *dst, Filter filter, int v0, int v1)
+{
+	if (!simd_native(src, filter))
+		mapping_rendering<SymmetricMapping<> >(src, dst, filter, v0, v1);
+	else
+		simd_rendering<Avx2>(src, dst, filter, 0, v0, v1);
+}
+
+AVX2_TARGET static void avx2_indexing(const Image *src, const Image *dst, Filter filter, void *lut, int v0, int v1)
+{
+	if (filter == FilterNearest)
+		simd_map<Avx2, SimdIndex, uint8_t, 3>(src, dst, 0, lut, v0, v1);
+	else
+		mapping_indexing<SymmetricMapping<> >(src, dst, filter, lut, v0, v1);
+}
+
+AVX2_TARGET static void avx2_rotated_rendering(const Image *src, Image *dst, Filter filter, const mat3 &m,
+					       int v0, int v1)
+{
+	if (!simd_native(src, filter))
+		rotated_rendering<LatLong, Cubemap>(src, dst, filter, m, v0, v1);
+	else
+		simd_rendering<Avx2>(src, dst, filter, &m, v0, v1);
+}
+
+AVX2_TARGET static void avx2_rotated_indexing(const Image *src, const Image *dst, Filter filter, const mat3 &m,
+					      void *lut, int v0, int v1)
+{
+	if (filter == FilterNearest)
+		simd_map<Avx2, SimdIndex, uint8_t, 3>(src, dst, &m, lut, v0, v1);
+	else
+		rotated_indexing<LatLong, Cubemap>(src, dst, filter, m, lut, v0, v1);
+}
+
+AVX512_TARGET static void avx512_rendering(const Image *src, Image *dst, Filter filter, int v0, int v1)
+{
+	if (!simd_native(src, filter))
+		mapping_rendering<SymmetricMapping<> >(src, dst, filter, v0, v1);
+	else
+		simd_rendering<Avx512>(src, dst, filter, 0, v0, v1);
+}
+
+AVX512_TARGET static void avx512_indexing(const Image *src, const Image *dst, Filter filter, void *lut, int v0, int v1)
+{
+	if (filter == FilterNearest)
+		simd_map<Avx512, SimdIndex, uint8_t, 3>(src, dst, 0, lut, v0, v1);
+	else
+		mapping_indexing<SymmetricMapping<> >(src, dst, filter, lut, v0, v1);
+}
+
+AVX512_TARGET static void avx512_rotated_rendering(const Image *src, Image *dst, Filter filter, const mat3 &m,
+						   int v0, int v1)
+{
+	if (!simd_native(src, filter))
+		rotated_rendering<LatLong, Cubemap>(src, dst, filter, m, v0, v1);
+	else
+		simd_rendering<Avx512>(src, dst, filter, &m, v0, v1);
+}
+
+AVX512_TARGET static void avx512_rotated_indexing(const Image *src, const Image *dst, Filter filter, const mat3 &m,
+						  void *lut, int v0, int v1)
+{
+	if (filter == FilterNearest)
+		simd_map<Avx512, SimdIndex, uint8_t, 3>(src, dst, &m, lut, v0, v1);
+	else
+		rotated_indexing<LatLong, Cubemap>(src, dst, filter, m, lut, v0, v1);
+}
+
+#endif
+/* }}} */
+
+/* {{{ Kernel selection */
+// Rendering kernels of a projection pair, the first one is the reference
+// and the rest are in order of preference
+struct Kernel
+{
+	const char *name;
+	// CPU support check, always supported if null
+	bool (*supported)();
+	// Render target rows [v0, v1)
+	void (*rendering)(const Image *src, Image *dst, Filter filter, int v0, int v1);
+	// Lookup table construction for target rows [v0, v1), see mapping_indexing
+	void (*indexing)(const Image *src, const Image *dst, Filter filter, void *lut, int v0, int v1);
+	// Largest direction error in radians of approximated trigonometry, 0 if
+	// libm
+	float maxError;
+	// Rendering and lookup table construction of a rotated source, see
+	// Orientation, null if the kernel relies on the unrotated geometry
+	void (*rotatedRendering)(const Image *src, Image *dst, Filter filter, const mat3 &m, int v0, int v1);
+	void (*rotatedIndexing)(const Image *src, const Image *dst, Filter filter, const mat3 &m, void *lut,
+				int v0, int v1);
+	// Whether rendering samples src with filter itself rather than falling
+	// back to a scalar mapping, always if null
+	bool (*native)(const Image *src, Filter filter);
+
+	// Whether the error stays below half a texel of a latlong source, a
+	// radian being h / pi texels both across and along
+	bool accurate(const Image *src) const { return maxError * src->h / M_PI < 0.5; }
+	// Whether the error is float rounding, as that of libm
+	bool exact() const { return maxError < 1e-6f; }
+
+	// Rendering and indexing of the source in orientation o
+	void render(const Image *src, Image *dst, Filter filter, const Orientation &o, int v0, int v1) const
+	{
+		if (o.identity())
+			rendering(src, dst, filter, v0, v1);
+		else
+			rotatedRendering(src, dst, filter, o.m, v0, v1);
+	}
+	void index(const Image *src, const Image *dst, Filter filter, const Orientation &o, void *lut,
+		   int v0, int v1) const
+	{
+		if (o.identity())
+			indexing(src, dst, filter, lut, v0, v1);
+		else
+			rotatedIndexing(src, dst, filter, o.m, lut, v0, v1);
+	}
+};
+
+#define REFERENCE_KERNEL(Source, Target) \
+	{"reference", 0, mapping_rendering<ReferenceMapping<Source, Target> >, \
+	 mapping_indexing<ReferenceMapping<Source, Target> >, 0., \
+	 rotated_rendering<Source, Target>, rotated_indexing<Source, Target>}
+
+static const Kernel latLongCubemapKernels[] = {
+	REFERENCE_KERNEL(LatLong, Cubemap),
+#if defined(__x86_64__) || defined(__i386__)
+	{"avx512", Avx512::supported, avx512_rendering, avx512_indexing, simdMaxError,
+	 avx512_rotated_rendering, avx512_rotated_indexing, simd_native},
+	{"avx2", Avx2::supported, avx2_rendering, avx2_indexing, simdMaxError,
+	 avx2_rotated_rendering, avx2_rotated_indexing, simd_native},
+#endif
+	{"symmetric", 0, mapping_rendering<SymmetricMapping<> >, mapping_indexing<SymmetricMapping<> >},
+	{"incremental", 0, mapping_rendering<IncrementalMapping>, mapping_indexing<IncrementalMapping>,
+	 IncrementalMapping::maxError},
+	{"fixed", 0, fixed_rendering<SymmetricMapping<> >, mapping_indexing<SymmetricMapping<> >, 0., 0, 0, fixed_native},
+	{"fast", 0, mapping_rendering<SymmetricMapping<FastMath> >, mapping_indexing<SymmetricMapping<FastMath> >,
+	 FastMath::maxError},
+};
+
+static const Kernel cubemapLatLongKernels[] = {
+	REFERENCE_KERNEL(Cubemap, LatLong),
+	{"separable", 0, mapping_rendering<SeparableMapping<> >, mapping_indexing<SeparableMapping<> >},
+	{"fixed", 0, fixed_rendering<SeparableMapping<> >, mapping_indexing<SeparableMapping<> >, 0., 0, 0,
+	 fixed_native},
+};
+
+static const Kernel latLongEacKernels[] = {
+	REFERENCE_KERNEL(LatLong, Eac),
+	{"symmetric", 0, mapping_rendering<SymmetricMapping<ExactMath, EquiAngularWarp> >,
+	 mapping_indexing<SymmetricMapping<ExactMath, EquiAngularWarp> >},
+	{"fixed", 0, fixed_rendering<SymmetricMapping<ExactMath, EquiAngularWarp> >,
+	 mapping_indexing<SymmetricMapping<ExactMath, EquiAngularWarp> >, 0., 0, 0, fixed_native},
+};
+
+static const Kernel eacLatLongKernels[] = {
+	REFERENCE_KERNEL(Eac, LatLong),
+	{"separable", 0, mapping_rendering<SeparableMapping<Eac> >, mapping_indexing<SeparableMapping<Eac> >},
+	{"fixed", 0, fixed_rendering<SeparableMapping<Eac> >, mapping_indexing<SeparableMapping<Eac> >, 0., 0, 0,
+	 fixed_native},
+};
+
+static const Kernel latLongLatLongKernels[] = {
+	REFERENCE_KERNEL(LatLong, LatLong),
+};
+
+#undef REFERENCE_KERNEL
+
+// Source and target projection pair
+struct Conversion
+{
+	const char *source, *target;
+	bool (*accepts)(const Image *img);
+	void (*targetSize)(const Image *img, int size, int *w, int *h);
+	// Render target rows [v0, v1) with the area filter
+	void (*areaRendering)(const Mipmap *mip, Image *dst, int v0, int v1);
+	// Streamed conversion, see Tile
+	void (*tileRows)(const Image *src, const Image *dst, Filter filter, Tile *t);
+	void (*tileRendering)(const Image *src, const Image *dst, Filter filter, const Tile &t,
+			      uint8_t *out, ptrdiff_t stride);
+	int sourceFaces, targetFaces;
+	const Kernel *kernels;
+	int kernelCount;
+
+	// Fastest exact kernel supported by the CPU for "auto"
+	const Kernel *findKernel(const char *name) const
+	{
+		bool any = strcmp(name, "auto") == 0;
+		for (int i = any ? 1 : 0; i < kernelCount; i++) {
+			const Kernel &k = kernels[i];
+			if (any ? (!k.supported || k.supported()) && k.exact() : strcmp(k.name, name) == 0)
+				return &k;
+		}
+		return any ? kernels : 0;
+	}
+};
+
+#define CONVERSION(source, target, Source, Target, kernels) \
+	{source, target, Source::accepts, Target::targetSize, area_rendering<Source, Target>, \
+	 tile_rows<Source, Target>, tile_rendering<Source, Target>, Source::faces, Target::faces, \
+	 kernels, sizeof(kernels) / sizeof(*kernels)}
+
+static const Conversion conversions[] = {
+	CONVERSION("latlong", "cubemap", LatLong, Cubemap, latLongCubemapKernels),
+	CONVERSION("cubemap", "latlong", Cubemap, LatLong, cubemapLatLongKernels),
+	CONVERSION("latlong", "latlong", LatLong, LatLong, latLongLatLongKernels),
+	CONVERSION("latlong", "eac", LatLong, Eac, latLongEacKernels),
+	CONVERSION("eac", "latlong", Eac, LatLong, eacLatLongKernels),
+};
+
+#undef CONVERSION
+
+static const char *const defaultSource = "latlong";
+static const char *const defaultTarget = "cubemap";
+static const char *const defaultKernel = "auto";
+
+static const Conversion *findConversion(const char *source, const char *target)
+{
+	for (const Conversion &c: conversions)
+		if (strcmp(c.source, source) == 0 && strcmp(c.target, target) == 0)
+			return &c;
+	return 0;
+}
+/* }}} */
+
+/* {{{ Sampling lookup table */
+// Source sampling of every target texel, reusable for all images with
+// the same source and target dimensions
+struct Lut
+{
+	// Cache file header, followed by the table in host byte order
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		int32_t sw, sh, dw, dh;
+		int32_t filter;
+		// Orientation angles, zero in files of earlier builds
+		float yaw, pitch, roll;
+		// Name of the kernel that filled the table, approximate kernels
+		// sampling slightly differently; empty in files of earlier builds,
+		// which never match
+		char kernel[16];
+		uint8_t reserved[4];
+	};
+
+	Lut() : sw(0), sh(0), dw(0), dh(0), filter(FilterNearest), kernel(0), data(0), mem(0), map(0), mapSize(0) {}
+	~Lut() { release(); }
+
+	bool matches(const Kernel *kernel, const Image *src, const Image *dst, Filter filter, const Orientation &o) const
+	{
+		return data && this->kernel == kernel && sw == src->w && sh == src->h && dw == dst->w && dh == dst->h &&
+			this->filter == filter && orient.yaw == o.yaw && orient.pitch == o.pitch && orient.roll == o.roll;
+	}
+	// Build the table in memory
+	bool build(ThreadPool *pool, const Kernel *kernel, Filter filter, const Orientation &o,
+		   const Image *src, const Image *dst);
+	// Map an existing cache file, fails if it does not match
+	bool load(const char *path, const Kernel *kernel, Filter filter, const Orientation &o,
+		  const Image *src, const Image *dst);
+	// Build the table directly into a new cache file
+	bool save(const char *path, ThreadPool *pool, const Kernel *kernel, Filter filter, const Orientation &o,
+		  const Image *src, const Image *dst);
+	void release();
+
+	// Cache file name in dir for the projections, kernel, filter and
+	// orientation
+	static void cachePath(char *path, size_t size, const char *dir, const Conversion *conv, const Kernel *kernel,
+			      Filter filter, const Orientation &o, const Image *src, const Image *dst);
+
+	int sw, sh, dw, dh;
+	Filter filter;
+	const Kernel *kernel;
+	Orientation orient;
+	// Entries as written by Kernel::indexing
+	const void *data;
+
+private:
+	void fill(ThreadPool *pool, const Kernel *kernel, Filter filter, const Orientation &o,
+		  const Image *src, const Image *dst, void *data);
+	static size_t size(Filter filter, const Image *dst)
+	{
+		return (size_t)dst->w * dst->h * (filter == FilterNearest ? sizeof(uint32_t) : sizeof(Image::Coord));
+	}
+
+	static const char magic[8];
+	static const uint32_t version = 2;
+
+	void *mem, *map;
+	size_t mapSize;
+};
+
+const char Lut::magic[8] = {'u', 'v', 'p', 'L', 'U', 'T', 0, 0};
+
+void Lut::fill(ThreadPool *pool, const Kernel *kernel, Filter filter, const Orientation &o,
+	       const Image *src, const Image *dst, void *data)
+{
+	sw = src->w;
+	sh = src->h;
+	dw = dst->w;
+	dh = dst->h;
+	this->filter = filter;
+	this->kernel = kernel;
+	orient = o;
+	parallel_rows(pool, dh, [&](int v0, int v1) {
+		kernel->index(src, dst, filter, o, data, v0, v1);
+	});
+	this->data = data;
+}
+
+bool Lut::build(ThreadPool *pool, const Kernel *kernel, Filter filter, const Orientation &o,
+		const Image *src, const Image *dst)
+{
+	release();
+	if (!(mem = malloc(size(filter, dst))))
+		return false;
+	fill(pool, kernel, filter, o, src, dst, mem);
+	return true;
+}
+
+bool Lut::load(const char *path, const Kernel *kernel, Filter filter, const Orientation &o,
+	       const Image *src, const Image *dst)
+{
+	release();
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	size_t size = sizeof(Header) + this->size(filter, dst);
+	void *p = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size == size)
+		p = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+
+	const Header *hdr = (const Header *)p;
+	if (memcmp(hdr->magic, magic, sizeof(magic)) || hdr->version != version ||
+	    hdr->sw != src->w || hdr->sh != src->h || hdr->dw != dst->w || hdr->dh != dst->h ||
+	    hdr->filter != filter || hdr->yaw != o.yaw || hdr->pitch != o.pitch || hdr->roll != o.roll ||
+	    strncmp(hdr->kernel, kernel->name, sizeof(hdr->kernel))) {
+		munmap(p, size);
+		return false;
+	}
+	map = p;
+	mapSize = size;
+	sw = hdr->sw;
+	sh = hdr->sh;
+	dw = hdr->dw;
+	dh = hdr->dh;
+	this->filter = filter;
+	this->kernel = kernel;
+	orient = o;
+	data = hdr + 1;
+	return true;
+}
+
+bool Lut::save(const char *path, ThreadPool *pool, const Kernel *kernel, Filter filter, const Orientation &o,
+	       const Image *src, const Image *dst)
+{
+	release();
+	// Build under a temporary name so other processes never map a partial file
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	size_t size = sizeof(Header) + this->size(filter, dst);
+	void *p = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+		p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		unlink(tmp);
+		return false;
+	}
+
+	Header *hdr = (Header *)p;
+	memset(hdr, 0, sizeof(Header));
+	memcpy(hdr->magic, magic, sizeof(magic));
+	hdr->version = version;
+	hdr->sw = src->w;
+	hdr->sh = src->h;
+	hdr->dw = dst->w;
+	hdr->dh = dst->h;
+	hdr->filter = filter;
+	hdr->yaw = o.yaw;
+	hdr->pitch = o.pitch;
+	hdr->roll = o.roll;
+	snprintf(hdr->kernel, sizeof(hdr->kernel), "%s", kernel->name);
+	map = p;
+	mapSize = size;
+	fill(pool, kernel, filter, o, src, dst, hdr + 1);
+	if (rename(tmp, path) != 0) {
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+void Lut::release()
+{
+	free(mem);
+	if (map)
+		munmap(map, mapSize);
+	mem = map = 0;
+	mapSize = 0;
+	data = 0;
+}
+
+void Lut::cachePath(char *path, size_t size, const char *dir, const Conversion *conv, const Kernel *kernel,
+		    Filter filter, const Orientation &o, const Image *src, const Image *dst)
+{
+	char rot[64] = "";
+	if (!o.identity())
+		snprintf(rot, sizeof(rot), "-ypr%g,%g,%g", o.yaw, o.pitch, o.roll);
+	snprintf(path, size, "%s/%s-%s-%s-%s-%dx%d-%dx%d%s.lut", dir, conv->source, conv->target,
+		 kernel->name, filterNames[filter], src->w, src->h, dst->w, dst->h, rot);
+}
+/* }}} */
+
+/* {{{ Verification */
+// Compare the output pixels of dst against the reference kernel with
+// filter, counting the texels with any differing component
+static bool compare(ThreadPool *pool, const Conversion *conv, Filter filter, const Orientation &o,
+		    const Image *src, const Image *dst)
+{
+	Image ref = *dst;
+	if (!ref.alloc())
+		return false;
+	if (ref.layout)
+		ref.layout->clearGaps(ref.ptr, ref.texel());
+	parallel_rows(pool, ref.h, [&](int v0, int v1) {
+		conv->kernels[0].render(src, &ref, filter, o, v0, v1);
+	});
+
+	// Over all texels stored, those around faces being zero in both
+	size_t size = (size_t)dst->w * dst->h, stored = dst->texels(), diff = 0;
+	double emax = 0.;
+	with_component(dst->type, [&](auto t) {
+		typedef Component<decltype(t)> C;
+		const decltype(t) *a = (const decltype(t) *)dst->ptr, *b = (const decltype(t) *)ref.ptr;
+		for (size_t i = 0; i != stored; i++) {
+			double e = 0.;
+			for (int k = 0; k != dst->n; k++) {
+				double d = fabs((double)C::get(a[i * dst->n + k]) - (double)C::get(b[i * dst->n + k]));
+				e = d > e ? d : e;
+			}
+			diff += e != 0.;
+			emax = e > emax ? e : emax;
+		}
+	});
+	free(ref.ptr);
+	printf(ESC_BLUE "Verification: %zu of %zu pixels differ from reference output (%.4f%%), "
+	       "max difference %.4g\n" ESC_DEFAULT, diff, size, 100. * diff / size, emax);
+	return true;
+}
+
+// Check the net of a face layout: count the edges between neighbouring
+// grid cells that join on the cube, every pair of texels across them
+// being within three texels of direction, with the mean component
+// difference across joined edges
+static void seams(const Image *dst)
+{
+	const FaceLayout *l = dst->layout;
+	const int s = l->s, w = l->w, n = dst->n;
+	if (s < 2)
+		return;
+	// Face texel of every stored texel, f * s * s + v * s + u
+	std::vector<int32_t> owner((size_t)w * l->h, -1);
+	for (int f = 0; f != 6; f++)
+		for (int v = 0; v != s; v++)
+			for (int u = 0; u != s; u++)
+				owner[l->at(f, u, v)] = (f * s + v) * s + u;
+	auto dir = [&](size_t i) {
+		const int o = owner[i], u = o % s, v = o / s % s;
+		return Cubemap::uvToEuclidean(vec2(((float)u + 0.5) / s, ((float)v + 0.5) / s), o / s / s).normalized();
+	};
+	int edges = 0, joined = 0;
+	double across = 0.;
+	with_component(dst->type, [&](auto t) {
+		typedef Component<decltype(t)> C;
+		const decltype(t) *p = (const decltype(t) *)dst->ptr;
+		auto diff = [&](size_t a, size_t b) {
+			double d = 0.;
+			for (int k = 0; k != n; k++)
+				d += fabs((double)C::get(p[a * n + k]) - (double)C::get(p[b * n + k]));
+			return d;
+		};
+		for (int c = 0; c != l->cols * l->rows; c++)
+			for (int down = 0; down != 2; down++) {
+				const int cx = c % l->cols, cy = c / l->cols;
+				const int nx = cx + !down, ny = cy + down;
+				if (nx == l->cols || ny == l->rows || !(l->used >> c & 1) || !(l->used >> (ny * l->cols + nx) & 1))
+					continue;
+				edges++;
+				// Last texels of the cell along the edge, and steps across it
+				// and along it
+				const ptrdiff_t step = down ? w : 1, along = down ? 1 : w;
+				const size_t e = down ? (size_t)(cy * s + s - 1) * w + cx * s : (size_t)cy * s * w + cx * s + s - 1;
+				bool ok = true;
+				double a = 0.;
+				for (int k = 0; ok && k != s; k++) {
+					const size_t i = e + k * along;
+					ok = acosf(std::min(dir(i).dot(dir(i + step)), 1.f)) < 3.f / s;
+					a += diff(i, i + step);
+				}
+				if (ok) {
+					joined++;
+					across += a;
+				}
+			}
+	});
+	const double count = (double)joined * s * n;
+	printf(ESC_BLUE "Seams: %d of %d edges between neighbouring cells join on the cube, mean difference "
+	       "%.4g across them\n" ESC_DEFAULT, joined, edges, count ? across / count : 0.);
+}
+
+// Compare the nearest source texels sampled by kernel, or through the
+// nearest filter lookup table idx if given, against the reference kernel,
+// then the seams of a face layout and the output pixels unless rendered
+// from a tiled source or with the area filter, which only the reference
+// supports
+static bool verify(ThreadPool *pool, const Conversion *conv, const Kernel *kernel, Filter filter,
+		   const Orientation &o, const Image *src, const Image *dst, const uint32_t *idx)
+{
+	size_t size = (size_t)dst->w * dst->h;
+	uint32_t *ref = (uint32_t *)malloc(size * sizeof(uint32_t));
+	uint32_t *tmp = idx ? 0 : (uint32_t *)malloc(size * sizeof(uint32_t));
+	if (!ref || (!idx && !tmp)) {
+		free(ref);
+		free(tmp);
+		return false;
+	}
+	parallel_rows(pool, dst->h, [&](int v0, int v1) {
+		conv->kernels[0].index(src, dst, FilterNearest, o, ref, v0, v1);
+		if (tmp)
+			kernel->index(src, dst, FilterNearest, o, tmp, v0, v1);
+	});
+	if (!idx)
+		idx = tmp;
+
+	size_t diff = 0;
+	int dmax = 0;
+	for (size_t i = 0; i != size; i++) {
+		if (idx[i] == ref[i])
+			continue;
+		int du = abs((int)(idx[i] % src->w) - (int)(ref[i] % src->w));
+		int dv = abs((int)(idx[i] / src->w) - (int)(ref[i] / src->w));
+		du = du < src->w - du ? du : src->w - du;
+		dmax = du > dmax ? du : dmax;
+		dmax = dv > dmax ? dv : dmax;
+		diff++;
+	}
+	free(ref);
+	free(tmp);
+	printf(ESC_BLUE "Verification: %zu of %zu texels differ from reference (%.4f%%), "
+	       "max distance %d texel(s)\n" ESC_DEFAULT, diff, size, 100. * diff / size, dmax);
+	if (dst->layout)
+		seams(dst);
+	return filter == FilterArea || src->tile || compare(pool, conv, filter, o, src, dst);
+}
+/* }}} */
+
+/* {{{ Round trip */
+// Convert dst back to the source projection, dimensions and orientation
+// with the inverse conversion, reporting the time taken and the error
+// against src
+static bool roundTrip(ThreadPool *pool, const Conversion *conv, const Kernel *kernel, Filter filter,
+		      const Orientation &o, const Image *src, const Image *dst)
+{
+	const Conversion *back = findConversion(conv->target, conv->source);
+	if (!back) {
+		fputs(ESC_RED "No inverse conversion for a round trip\n" ESC_DEFAULT, stderr);
+		return false;
+	}
+	if (!(kernel = back->findKernel(kernel->name)) || (!o.identity() && !kernel->rotatedRendering))
+		kernel = back->findKernel(o.identity() ? defaultKernel : "reference");
+	const Orientation inv = o.inverse();
+	Image img = *src;
+	img.tile = 0;
+	Mipmap mip;
+	if (!img.alloc() || (filter == FilterArea && !mip.build(pool, dst))) {
+		free(img.ptr);
+		fputs(ESC_RED "Error allocating round trip memory\n" ESC_DEFAULT, stderr);
+		return false;
+	}
+
+	struct timeval tStart, tEnd, tElapsed;
+	printf(ESC_YELLOW "Round trip %s -> %s with %s kernel...\n" ESC_DEFAULT,
+	       back->source, back->target, filter == FilterArea ? "reference" : kernel->name);
+	gettimeofday(&tStart, NULL);
+	parallel_rows(pool, img.h, [&](int v0, int v1) {
+		if (filter == FilterArea)
+			back->areaRendering(&mip, &img, v0, v1);
+		else
+			kernel->render(dst, &img, filter, inv, v0, v1);
+	});
+	gettimeofday(&tEnd, NULL);
+	timersub(&tEnd, &tStart, &tElapsed);
+	printf(ESC_CYAN "Time elapsed: %ld.%06ld\n" ESC_DEFAULT, tElapsed.tv_sec, tElapsed.tv_usec);
+
+	size_t size = (size_t)img.w * img.h * img.n;
+	double sum = 0., sq = 0., emax = 0., peak = 0.;
+	with_component(img.type, [&](auto t) {
+		typedef Component<decltype(t)> C;
+		const decltype(t) *a = (const decltype(t) *)src->ptr, *b = (const decltype(t) *)img.ptr;
+		for (int v = 0; v != img.h; v++)
+			for (int u = 0; u != img.w; u++)
+				for (int k = 0; k != img.n; k++) {
+					size_t i = ((size_t)v * img.w + u) * img.n + k;
+					size_t j = TiledLayout::at(src, u, v) * img.n + k;
+					double e = fabs((double)C::get(a[j]) - (double)C::get(b[i]));
+					sum += e;
+					sq += e * e;
+					emax = e > emax ? e : emax;
+				}
+		peak = C::scale;
+	});
+	free(img.ptr);
+	double mse = sq / size;
+	printf(ESC_BLUE "Round trip error: mean %.4g, max %.4g, PSNR %.2f dB\n" ESC_DEFAULT,
+	       sum / size, emax, mse ? 10. * log10(peak * peak / mse) : INFINITY);
+	return true;
+}
+/* }}} */
+
+/* {{{ Mapped output */
+// Output file written through a shared mapping, so that texels can be
+// rendered in place: a 24-bit BGR BMP, bottom-up unless topDown, or RGB
+// rows without a header for a .raw path
+struct OutputMap
+{
+	OutputMap() : map(0), size(0) {}
+	~OutputMap() { close(); }
+
+	static bool isRaw(const char *path)
+	{
+		const char *ext = strrchr(path, '.');
+		return ext && strcasecmp(ext, ".raw") == 0;
+	}
+	// Whether w texel rows are contiguous, as rendering into data requires
+	static bool contiguous(const char *path, int w) { return isRaw(path) || (w * 3) % 4 == 0; }
+
+	bool create(const char *path, int w, int h, bool topDown);
+	void close()
+	{
+		if (map)
+			munmap(map, size);
+		map = 0;
+	}
+	// Row v from the top
+	uint8_t *row(int v) { return data + (ptrdiff_t)(topDown ? v : h - 1 - v) * stride; }
+	// Write back rendered rows and drop them from memory
+	void flush()
+	{
+		msync(map, size, MS_SYNC);
+		madvise(map, size, MADV_DONTNEED);
+	}
+
+	uint8_t *map, *data;
+	size_t size;
+	int w, h;
+	ptrdiff_t stride;
+	bool raw, topDown;
+};
+
+bool OutputMap::create(const char *path, int w, int h, bool topDown)
+{
+	const int headerSize = 54;
+	raw = isRaw(path);
+	this->w = w;
+	this->h = h;
+	this->topDown = topDown || raw;
+	stride = raw ? (size_t)w * 3 : ((size_t)w * 3 + 3) & ~3;
+	size = (raw ? 0 : headerSize) + stride * h;
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	void *p = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+		p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED)
+		return false;
+	map = (uint8_t *)p;
+	data = raw ? map : map + headerSize;
+	if (raw)
+		return true;
+
+	// BITMAPFILEHEADER and BITMAPINFOHEADER, little endian, a negative
+	// height for top-down rows
+	const uint32_t fields[] = {
+		(uint32_t)size, 0, headerSize,
+		40, (uint32_t)w, (uint32_t)(this->topDown ? -h : h), 1 | 24 << 16, 0,
+		(uint32_t)(size - headerSize), 0, 0, 0, 0,
+	};
+	map[0] = 'B';
+	map[1] = 'M';
+	for (size_t i = 0; i != sizeof(fields) / sizeof(*fields); i++)
+		for (int b = 0; b != 4; b++)
+			map[2 + i * 4 + b] = fields[i] >> (b * 8);
+	return true;
+}
+/* }}} */
+
+/* {{{ PNG output */
+// Deflate input per chunk, chunks are compressed in parallel and joined
+// with sync flushes into one zlib stream as in pigz, each primed with the
+// previous window so that matches may cross chunk boundaries
+static const size_t pngChunkSize = 256 << 10;
+static const size_t pngWindow = 32 << 10;
+
+static bool isPng(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+	return ext && strcasecmp(ext, ".png") == 0;
+}
+
+static inline int paeth(int a, int b, int c)
+{
+	int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Filter row p with the previous row q into out, filter type first. The
+// filter with the smallest sum of residuals taken as signed bytes is
+// kept, as libpng does; level 0 leaves rows unfiltered.
+static void png_filter_row(const uint8_t *p, const uint8_t *q, size_t len, int n, int level, uint8_t *out)
+{
+	auto residual = [](int type, int x, int a, int b, int c) -> uint8_t {
+		switch (type) {
+		case 1: return x - a;
+		case 2: return x - b;
+		case 3: return x - ((a + b) >> 1);
+		case 4: return x - paeth(a, b, c);
+		}
+		return x;
+	};
+	auto cost = [](uint8_t r) { return r < 128 ? r : 256 - r; };
+
+	unsigned sum[5] = {0, 0, 0, 0, 0};
+	for (size_t i = 0; level && i != len; i++) {
+		int x = p[i], a = i >= (size_t)n ? p[i - n] : 0, b = q[i], c = i >= (size_t)n ? q[i - n] : 0;
+		for (int type = 0; type != 5; type++)
+			sum[type] += cost(residual(type, x, a, b, c));
+	}
+	int type = 0;
+	for (int t = 1; t != 5; t++)
+		if (sum[t] < sum[type])
+			type = t;
+
+	*out++ = type;
+	for (size_t i = 0; i != len; i++)
+		out[i] = residual(type, p[i], i >= (size_t)n ? p[i - n] : 0, q[i], i >= (size_t)n ? q[i - n] : 0);
+}
+
+// Chunk data, length prefix and type included, followed by its CRC
+static bool png_chunk(FILE *fp, const char *type, const uint8_t *data, size_t len)
+{
+	uint8_t head[8] = {(uint8_t)(len >> 24), (uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len};
+	memcpy(head + 4, type, 4);
+	uLong crc = crc32(0, head + 4, 4);
+	// A null buffer would reset the CRC
+	if (len)
+		crc = crc32(crc, data, len);
+	uint8_t tail[4] = {(uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc};
+	return fwrite(head, 8, 1, fp) == 1 && (!len || fwrite(data, len, 1, fp) == 1) && fwrite(tail, 4, 1, fp) == 1;
+}
+
+// Filter rows and deflate chunks on the pool, then write one IDAT per
+// chunk; the first one carries the zlib header, the last one the
+// combined Adler-32. Takes 8 or 16-bit texels.
+static bool writePng(ThreadPool *pool, const char *path, const Image *img, int level)
+{
+	static const uint8_t colourTypes[] = {0, 0, 4, 2, 6};
+	struct Chunk
+	{
+		uint8_t *buf;
+		size_t size;
+		uLong adler;
+		bool ok;
+	};
+
+	const size_t len = (size_t)img->w * img->texel(), filtered = len + 1;
+	const bool wide = img->type == TypeU16;
+	const int rows = std::max<size_t>(1, pngChunkSize / filtered);
+	const int count = (img->h + rows - 1) / rows;
+	uint8_t *data = (uint8_t *)malloc(filtered * img->h), *zero = (uint8_t *)calloc(len, 1);
+	if (!data || !zero) {
+		free(data);
+		free(zero);
+		return false;
+	}
+
+	pool->run(count, [&](int i) {
+		// Row v with big endian samples, swapped into buf if needed
+		std::vector<uint8_t> swapped(wide ? len * 2 : 0);
+		auto row = [&](int v, uint8_t *buf) -> const uint8_t * {
+			const uint8_t *p = (const uint8_t *)img->ptr + len * v;
+			if (!wide)
+				return p;
+			for (size_t j = 0; j != len; j += 2) {
+				buf[j] = p[j + 1];
+				buf[j + 1] = p[j];
+			}
+			return buf;
+		};
+		// Two swap buffers for 16-bit rows, none for 8-bit ones
+		uint8_t *cur = wide ? swapped.data() : 0, *prev = wide ? cur + len : 0;
+		int v = i * rows;
+		const uint8_t *q = v ? row(v - 1, prev) : zero;
+		for (; v != std::min(i * rows + rows, img->h); v++) {
+			const uint8_t *p = row(v, cur);
+			png_filter_row(p, q, len, img->texel(), level, data + filtered * v);
+			q = p;
+			std::swap(cur, prev);
+		}
+	});
+	// Room for the zlib header before the first chunk and the checksum
+	// after the last one
+	std::vector<Chunk> chunks(count, Chunk{0, 0, 0, false});
+	pool->run(count, [&](int i) {
+		Chunk &c = chunks[i];
+		const uint8_t *in = data + filtered * rows * i;
+		const size_t size = filtered * std::min(rows, img->h - rows * i);
+		const bool last = i == count - 1;
+		z_stream z;
+		memset(&z, 0, sizeof(z));
+		if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return;
+		const size_t bound = deflateBound(&z, size) + 16;
+		if ((c.buf = (uint8_t *)malloc(bound + 6))) {
+			size_t dict = std::min(pngWindow, (size_t)(in - data));
+			if (dict)
+				deflateSetDictionary(&z, in - dict, dict);
+			z.next_in = (Bytef *)in;
+			z.avail_in = size;
+			z.next_out = c.buf + 2;
+			z.avail_out = bound;
+			int ret = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+			c.ok = z.avail_in == 0 && (last ? ret == Z_STREAM_END : ret == Z_OK);
+			c.size = bound - z.avail_out;
+			c.adler = adler32(adler32(0, 0, 0), in, size);
+		}
+		deflateEnd(&z);
+	});
+	bool ok = true;
+	for (const Chunk &c: chunks)
+		ok = ok && c.ok;
+	free(data);
+	free(zero);
+
+	FILE *fp = ok ? fopen(path, "wb") : 0;
+	if (fp) {
+		uLong adler = adler32(0, 0, 0);
+		for (int i = 0; i != count; i++)
+			adler = adler32_combine(adler, chunks[i].adler, filtered * std::min(rows, img->h - rows * i));
+		Chunk &first = chunks.front(), &last = chunks.back();
+		// CM 8 with a 32 KiB window, FLEVEL from the level, the default
+		// being 6, FCHECK
+		const int l = level == Z_DEFAULT_COMPRESSION ? 6 : level;
+		const int flevel = l < 2 ? 0 : l < 6 ? 1 : l == 6 ? 2 : 3;
+		const int header = 0x7800 | flevel << 6;
+		first.buf[0] = header >> 8;
+		first.buf[1] = (header + (31 - header % 31) % 31) & 0xff;
+		for (int b = 0; b != 4; b++)
+			last.buf[2 + last.size + b] = adler >> (24 - b * 8);
+
+		const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+		const uint8_t ihdr[13] = {
+			(uint8_t)(img->w >> 24), (uint8_t)(img->w >> 16), (uint8_t)(img->w >> 8), (uint8_t)img->w,
+			(uint8_t)(img->h >> 24), (uint8_t)(img->h >> 16), (uint8_t)(img->h >> 8), (uint8_t)img->h,
+			(uint8_t)(wide ? 16 : 8), colourTypes[img->n], 0, 0, 0,
+		};
+		ok = fwrite(signature, 8, 1, fp) == 1 && png_chunk(fp, "IHDR", ihdr, sizeof(ihdr));
+		for (int i = 0; ok && i != count; i++) {
+			const Chunk &c = chunks[i];
+			ok = png_chunk(fp, "IDAT", c.buf + (i ? 2 : 0), c.size + (i ? 0 : 2) + (i == count - 1 ? 4 : 0));
+		}
+		ok = ok && png_chunk(fp, "IEND", 0, 0);
+		ok = fclose(fp) == 0 && ok;
+	} else {
+		ok = false;
+	}
+	for (Chunk &c: chunks)
+		free(c.buf);
+	return ok;
+}
+/* }}} */
+
+/* {{{ PNG input */
+// stb_image narrows 16-bit PNG samples to 8 bits, non-interlaced 16-bit
+// PNGs are read here instead
+static bool isPng16(const char *path)
+{
+	// Interlaced files are left to stb, narrowed to 8 bits
+	uint8_t head[29];
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return false;
+	bool ok = fread(head, sizeof(head), 1, fp) == 1 && memcmp(head, "\x89PNG\r\n\x1a\n", 8) == 0 &&
+		memcmp(head + 12, "IHDR", 4) == 0 && head[24] == 16 && head[25] != 3 && head[28] == 0;
+	fclose(fp);
+	return ok;
+}
+
+static inline uint32_t png_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Grey, RGB and RGBA as 16-bit components of as many channels, grey with
+// alpha as RGBA
+static bool readPng16(const char *path, Image *img)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return false;
+	std::vector<uint8_t> idat;
+	uint8_t head[8], ihdr[13];
+	int channels = 0;
+	struct stat st;
+	bool ok = fstat(fileno(fp), &st) == 0 && fread(head, 8, 1, fp) == 1, end = false;
+	while (ok && !end && fread(head, 8, 1, fp) == 1) {
+		uint32_t len = png_be32(head);
+		// Chunks of corrupt files may claim more data than the file holds
+		if ((off_t)len > st.st_size - ftello(fp)) {
+			ok = false;
+			break;
+		}
+		if (memcmp(head + 4, "IHDR", 4) == 0 && len == sizeof(ihdr)) {
+			ok = fread(ihdr, sizeof(ihdr), 1, fp) == 1 && fseek(fp, 4, SEEK_CUR) == 0;
+			static const int colourChannels[7] = {1, 0, 3, 0, 2, 0, 4};
+			channels = ihdr[9] < 7 ? colourChannels[ihdr[9]] : 0;
+			ok = ok && ihdr[8] == 16 && channels && ihdr[10] == 0 && ihdr[11] == 0 && ihdr[12] == 0;
+		} else if (memcmp(head + 4, "IDAT", 4) == 0) {
+			size_t size = idat.size();
+			idat.resize(size + len);
+			ok = (!len || fread(&idat[size], len, 1, fp) == 1) && fseek(fp, 4, SEEK_CUR) == 0;
+		} else {
+			end = memcmp(head + 4, "IEND", 4) == 0;
+			ok = fseek(fp, len + 4, SEEK_CUR) == 0;
+		}
+	}
+	fclose(fp);
+	if (!ok || !end || !channels)
+		return false;
+
+	const int w = png_be32(ihdr), h = png_be32(ihdr + 4), bpp = channels * 2;
+	if (w < 1 || h < 1)
+		return false;
+	const size_t len = (size_t)w * bpp, filtered = len + 1;
+	uLongf size = filtered * h;
+	uint8_t *data = (uint8_t *)malloc(size);
+	Image out = {w, h, channels == 2 ? 4 : channels, 0, TypeU16};
+	if (!data || uncompress(data, &size, idat.data(), idat.size()) != Z_OK || size != filtered * h ||
+	    !out.alloc()) {
+		free(data);
+		return false;
+	}
+	uint16_t *dp = (uint16_t *)out.ptr;
+	std::vector<uint8_t> zero(len, 0);
+	for (int v = 0; v != h; v++) {
+		uint8_t *p = data + filtered * v + 1;
+		const uint8_t *q = v ? p - filtered : zero.data();
+		const int type = p[-1];
+		for (size_t i = 0; i != len; i++) {
+			int a = i >= (size_t)bpp ? p[i - bpp] : 0, b = q[i], c = i >= (size_t)bpp ? q[i - bpp] : 0;
+			p[i] += type == 1 ? a : type == 2 ? b : type == 3 ? (a + b) >> 1 : type == 4 ? paeth(a, b, c) : 0;
+		}
+		for (int u = 0; u != w; u++, dp += out.n)
+			for (int k = 0; k != out.n; k++) {
+				const uint8_t *s = p + u * bpp + (channels == 2 ? (k == 3) * 2 : k * 2);
+				dp[k] = s[0] << 8 | s[1];
+			}
+	}
+	free(data);
+	*img = out;
+	return true;
+}
+/* }}} */
+
+/* {{{ Image loading */
+Type Image::fileType(const char *path)
+{
+	return stbi_is_hdr(path) ? TypeFloat : isPng16(path) ? TypeU16 : TypeU8;
+}
+
+bool Image::load(const char *path)
+{
+	type = fileType(path);
+	if (type == TypeU16)
+		return readPng16(path, this);
+	// Samplers are specialised for 1, 3 and 4 channels
+	int comp;
+	if (!stbi_info(path, &w, &h, &comp))
+		return false;
+	const int req = comp == 1 ? 1 : comp == 3 ? 3 : 4;
+	if (type == TypeFloat)
+		ptr = stbi_loadf(path, &w, &h, &n, req);
+	else
+		ptr = stbi_load(path, &w, &h, &n, req);
+	if (!ptr)
+		return false;
+	n = req;
+	// Padded so that every texel can be read with a 32-bit load
+	void *p = realloc(ptr, bytes() + 4);
+	if (!p)
+		stbi_image_free(ptr);
+	return !!(ptr = p);
+}
+/* }}} */
+
+/* {{{ Streamed conversion */
+// Binary PPM source, read sequentially in row strips
+struct PpmReader
+{
+	PpmReader() : fp(0), w(0), h(0) {}
+	~PpmReader() { if (fp) fclose(fp); }
+
+	bool open(const char *path);
+	bool read(void *p, int rows) { return fread(p, (size_t)w * 3, rows, fp) == (size_t)rows; }
+	bool skip(int rows) { return fseeko(fp, (off_t)rows * w * 3, SEEK_CUR) == 0; }
+
+	FILE *fp;
+	int w, h;
+};
+
+bool PpmReader::open(const char *path)
+{
+	if (!(fp = fopen(path, "rb")))
+		return false;
+	int v[3], c;
+	if (fgetc(fp) != 'P' || fgetc(fp) != '6')
+		return false;
+	for (int i = 0; i != 3; i++) {
+		// Whitespace and comments between header fields
+		while ((c = fgetc(fp)) != EOF && (isspace(c) || c == '#'))
+			if (c == '#')
+				while ((c = fgetc(fp)) != EOF && c != '\n');
+		if (c == EOF || ungetc(c, fp) == EOF || fscanf(fp, "%d", &v[i]) != 1)
+			return false;
+	}
+	// A single whitespace character precedes the data
+	if (!isspace(fgetc(fp)) || v[0] < 1 || v[1] < 1 || v[2] != 255)
+		return false;
+	w = v[0];
+	h = v[1];
+	return true;
+}
+/* }}} */
+
+/* {{{ Instrumentation */
+// Seconds on the monotonic clock
+static double monotonic()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Size of the file at path, -1 if it cannot be read
+static long long fileSize(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+// Counters of a stage span, negative when they do not apply
+struct SpanCounters
+{
+	SpanCounters() : bytesRead(-1), bytesWritten(-1), texels(-1), misses{-1, -1} {}
+
+	long long bytesRead, bytesWritten;
+	// Target texels rendered, with cache misses while rendering them
+	long long texels, misses[2];
+};
+
+// Stage spans for log pipelines, as JSON lines or a Chrome trace event
+// array. JSON lines start with a header mapping the monotonic clock of
+// the spans to wall clock time.
+struct Trace
+{
+	enum Format {FormatLines, FormatChrome, FormatCount};
+
+	Trace() : fp(0), format(FormatLines), events(0) {}
+	~Trace() { close(); }
+
+	bool open(const char *path, Format format);
+	// False if the trace could not be written
+	bool close();
+	bool enabled() const { return fp; }
+	// Record stage [start, end) of the conversion of input to output,
+	// either may be null
+	void span(const char *stage, const char *input, const char *output, double start, double end,
+		  const SpanCounters &c);
+
+private:
+	FILE *fp;
+	Format format;
+	int events;
+	std::mutex mutex;
+};
+
+static const char *const traceFormats[Trace::FormatCount] = {"lines", "chrome"};
+
+static void jsonString(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+bool Trace::open(const char *path, Format format)
+{
+	close();
+	if (!(fp = fopen(path, "w")))
+		return false;
+	this->format = format;
+	events = 0;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	char host[256] = "";
+	gethostname(host, sizeof(host) - 1);
+	if (format == FormatChrome) {
+		fprintf(fp, "[{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": ", (int)getpid());
+		jsonString(fp, host);
+		fputs("}}", fp);
+		events++;
+	} else {
+		fprintf(fp, "{\"event\": \"start\", \"pid\": %d, \"host\": ", (int)getpid());
+		jsonString(fp, host);
+		fprintf(fp, ", \"wall_time\": %ld.%06ld, \"monotonic\": %.6f}\n", (long)now.tv_sec, (long)now.tv_usec,
+			monotonic());
+	}
+	return true;
+}
+
+bool Trace::close()
+{
+	if (!fp)
+		return true;
+	if (format == FormatChrome)
+		fputs("\n]\n", fp);
+	bool ok = !ferror(fp);
+	ok = fclose(fp) == 0 && ok;
+	fp = 0;
+	return ok;
+}
+
+void Trace::span(const char *stage, const char *input, const char *output, double start, double end,
+		 const SpanCounters &c)
+{
+	// Small thread numbers in order of first use
+	static std::atomic<int> threads(0);
+	static thread_local int tid = threads++;
+	if (!fp)
+		return;
+	std::lock_guard<std::mutex> lock(mutex);
+	const bool chrome = format == FormatChrome;
+	if (chrome)
+		fprintf(fp, ",\n{\"name\": \"%s\", \"cat\": \"conv\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, "
+			"\"ts\": %.3f, \"dur\": %.3f, \"args\": {", stage, (int)getpid(), tid, start * 1e6, (end - start) * 1e6);
+	else
+		fprintf(fp, "{\"event\": \"span\", \"stage\": \"%s\", \"pid\": %d, \"thread\": %d, \"start\": %.6f, "
+			"\"duration\": %.6f", stage, (int)getpid(), tid, start, end - start);
+	const char *sep = chrome ? "" : ", ";
+	if (input) {
+		fprintf(fp, "%s\"input\": ", sep);
+		jsonString(fp, input);
+		sep = ", ";
+	}
+	if (output) {
+		fprintf(fp, "%s\"output\": ", sep);
+		jsonString(fp, output);
+		sep = ", ";
+	}
+	const struct {
+		const char *name;
+		long long value;
+	} counters[] = {
+		{"bytes_read", c.bytesRead}, {"bytes_written", c.bytesWritten}, {"texels", c.texels},
+		{"l1d_misses", c.misses[0]}, {"llc_misses", c.misses[1]},
+	};
+	for (const auto &k: counters)
+		if (k.value >= 0) {
+			fprintf(fp, "%s\"%s\": %lld", sep, k.name, k.value);
+			sep = ", ";
+		}
+	if (c.texels >= 0 && end > start)
+		fprintf(fp, "%s\"texels_per_s\": %.0f", sep, c.texels / (end - start));
+	fputs(chrome ? "}}" : "}\n", fp);
+	events++;
+}
+/* }}} */
+
+/* {{{ main */
+static void help()
+{
+	fputs("conv [options] [INPUT OUTPUT]...\n"
+	      "OUTPUT is a PNG for a .png extension, compressed on all threads, Radiance\n"
+	      "HDR for .hdr, headerless rows for .raw, or a 24-bit BMP; 8-bit RGB raw and BMP\n"
+	      "are written through a memory mapping. PNG output keeps 16-bit sources,\n"
+	      "other formats are 8-bit except HDR. Grey and alpha are kept except in BMP.\n"
+	      "  -j, --jobs JOBS      Rendering threads (default: number of CPUs)\n"
+	      "      --source NAME    Input projection: latlong, cubemap or eac, the\n"
+	      "                       equi-angular cubemap (default: latlong)\n"
+	      "      --target NAME    Output projection (default: cubemap)\n"
+	      "      --layout NAME    Cube face arrangement: strip of +X, -X, +Y, -Y, +Z\n"
+	      "                       and -Z, 3x2 as YouTube equi-angular cubemaps, left,\n"
+	      "                       front and right over down, back and up turned a\n"
+	      "                       quarter, hcross or vcross around +Z, or faces, one\n"
+	      "                       OUTPUT per face suffixed _px to _nz, written in\n"
+	      "                       place while rendering (default: strip)\n"
+	      "      --face-orientation NAME  Face texel orientation: native, seen from\n"
+	      "                       the centre, or gl, the cube map faces of GL, which\n"
+	      "                       Direct3D and Vulkan share (default: native)\n"
+	      "      --yaw DEG        Rotate the source so that the target centre looks\n"
+	      "      --pitch DEG      at longitude yaw and elevation pitch, turned by\n"
+	      "      --roll DEG       roll, in the mapping and lookup tables (default: 0)\n"
+	      "  -k, --kernel NAME    Rendering kernel (default: auto, fastest supported);\n"
+	      "                       fast and incremental approximate the angles and\n"
+	      "                       fall back to the reference above half a texel of\n"
+	      "                       error\n"
+	      "  -f, --filter NAME    Source sampling filter: nearest, bilinear, bicubic or\n"
+	      "                       area, integrating over the texel footprint when\n"
+	      "                       downsampling (default: bilinear)\n"
+	      "  -s, --size SIZE      Cube face size or latlong height (default: keep the\n"
+	      "                       pixel count of INPUT)\n"
+	      "  -b, --batch LIST     Convert the INPUT OUTPUT pairs listed one per line\n"
+	      "                       in LIST, - for standard input\n"
+	      "  -g, --glob PATTERN   Convert every INPUT matching PATTERN, saved to the\n"
+	      "                       output directory\n"
+	      "  -o, --output-dir DIR Output directory for --glob (default: .)\n"
+	      "  -m, --max-memory MB  Stream inputs that would not fit, reading binary PPM\n"
+	      "                       sources in row strips into a memory mapped output\n"
+	      "  -z, --png-level N    PNG compression level, 0 to 9 (default: 6)\n"
+	      "  -p, --precision TYPE Source components: u8, u16, half or float (default:\n"
+	      "                       float for HDR, u16 for 16-bit PNG, u8 otherwise)\n"
+	      "      --rgbx           Pad RGB sources to 4 channels in memory, sampled\n"
+	      "                       with one 32-bit load per 8-bit texel\n"
+	      "      --order NAME     Target traversal: rows, all faces at once with the\n"
+	      "                       kernel, or one face at a time with the reference\n"
+	      "                       mapping in face row bands, tiled, morton or hilbert\n"
+	      "                       ordered tiles (default: rows)\n"
+	      "      --tiled-source   Store the source in 16x16 texel tiles, rendered\n"
+	      "                       with --order tiled unless another order is given\n"
+	      "  -l, --lut            Precompute a sampling lookup table, reused for\n"
+	      "                       every input with the same dimensions\n"
+	      "  -c, --lut-cache DIR  Memory map lookup tables from cache files in DIR,\n"
+	      "                       creating them if needed (implies --lut)\n"
+	      "      --verify         Compare sampled texels and output pixels against the\n"
+	      "                       reference kernel\n"
+	      "      --round-trip     Convert the output back and report the error\n"
+	      "      --bench HEIGHT   Time every kernel and filter on a synthetic source\n"
+	      "                       HEIGHT texels high instead of converting, with the\n"
+	      "                       projections, size, precision and --rgbx given,\n"
+	      "                       and every traversal order with --order or\n"
+	      "                       --tiled-source\n"
+	      "      --iterations N   Timed runs per kernel and filter (default: 10)\n"
+	      "      --json FILE      Save benchmark results as JSON, - for standard output\n"
+	      "      --trace FILE     Record the time of every stage on the monotonic\n"
+	      "                       clock with bytes read and written and texels/s\n"
+	      "      --trace-format F JSON lines, one span per line after a header, or a\n"
+	      "                       chrome trace event array (default: lines)\n"
+	      "Projections and kernels:\n", stderr);
+	for (const Conversion &c: conversions) {
+		fprintf(stderr, "  %s -> %s:", c.source, c.target);
+		for (int i = 0; i != c.kernelCount; i++)
+			fprintf(stderr, " %s", c.kernels[i].name);
+		fputc('\n', stderr);
+	}
+}
+
+// Conversion settings and state shared by all inputs
+struct Context
+{
+	Context() : conv(0), kernel(0), filter(FilterBilinear), size(0), useLut(false), cacheDir(0), verify(false), roundTrip(false),
+		    maxMemory(0), pngLevel(Z_DEFAULT_COMPRESSION), precision(TypeCount), rgbx(false),
+		    order(OrderRows), tiledSource(false), layout(LayoutStrip), faceOrientation(FacesNative), status(0) {}
+
+	// First error, later frames are skipped
+	void fail(int ret)
+	{
+		int ok = 0;
+		status.compare_exchange_strong(ok, ret);
+	}
+
+	ThreadPool pool;
+	// PNG compression, on the saver thread while pool renders
+	ThreadPool encoders;
+	const Conversion *conv;
+	const Kernel *kernel;
+	Filter filter;
+	int size;
+	bool useLut;
+	const char *cacheDir;
+	bool verify;
+	bool roundTrip;
+	// Bytes, 0 for no limit
+	size_t maxMemory;
+	int pngLevel;
+	// Source component type, TypeCount to keep the file's
+	Type precision;
+	// Pad RGB sources to 4 channels, one 32-bit load per 8-bit texel
+	bool rgbx;
+	// Target traversal, other orders than rows render tiles of the
+	// reference mapping instead of the kernel
+	Order order;
+	// Store sources in square tiles, needs an order other than rows
+	bool tiledSource;
+	// Source rotation applied by the reference mapping and lookup tables
+	Orientation orient;
+	// Cube map target face storage, see FaceLayout
+	Layout layout;
+	FaceOrientation faceOrientation;
+	Lut lut;
+	Mipmap mip;
+	Trace trace;
+	std::atomic<int> status;
+};
+
+// Input and output of one conversion, moving through the pipeline
+struct Frame
+{
+	const char *input, *output;
+	Image src;
+	// Pipeline buffer, rendered to unless the output is mapped
+	Image *buffer;
+	Image dst;
+	OutputMap out;
+	// RGB source padded to RGBX, the padding is not saved
+	bool padded;
+	// Face storage of dst other than the native strip
+	FaceLayout layout;
+};
+
+static bool isHdr(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+	return ext && strcasecmp(ext, ".hdr") == 0;
+}
+
+// Print the time since start, and record it in the trace as stage of
+// frame f
+static void printElapsed(Context *ctx, const Frame *f, const char *stage, double start,
+			 const SpanCounters &c = SpanCounters())
+{
+	double end = monotonic();
+	printf(ESC_CYAN "Time elapsed: %.6f\n" ESC_DEFAULT, end - start);
+	ctx->trace.span(stage, f->input, f->output, start, end, c);
+}
+
+static int loadFrame(Context *ctx, Frame *f)
+{
+	printf(ESC_YELLOW "Loading input image %s...\n" ESC_DEFAULT, f->input);
+	double tStart = monotonic();
+	if (!f->src.load(f->input)) {
+		fprintf(stderr, ESC_RED "Error loading input image %s\n" ESC_DEFAULT, f->input);
+		return 2;
+	}
+	if (!ctx->conv->accepts(&f->src)) {
+		fprintf(stderr, ESC_RED "Invalid %s input image size\n" ESC_DEFAULT, ctx->conv->source);
+		stbi_image_free(f->src.ptr);
+		return 2;
+	}
+	// On the loader thread, the pool may be rendering
+	Image img;
+	const Type type = ctx->precision != TypeCount ? ctx->precision : f->src.type;
+	f->padded = ctx->rgbx && f->src.n == 3;
+	if (type != f->src.type || f->padded) {
+		if (!convert_image(0, &f->src, &img, type, f->padded ? 4 : f->src.n)) {
+			fputs(ESC_RED "Error allocating image memory\n" ESC_DEFAULT, stderr);
+			stbi_image_free(f->src.ptr);
+			return 4;
+		}
+		stbi_image_free(f->src.ptr);
+		f->src = img;
+	}
+	if (ctx->tiledSource) {
+		if (!tile_image(0, &f->src, &img, sourceTile)) {
+			fputs(ESC_RED "Error allocating image memory\n" ESC_DEFAULT, stderr);
+			stbi_image_free(f->src.ptr);
+			return 4;
+		}
+		stbi_image_free(f->src.ptr);
+		f->src = img;
+	}
+	printf(ESC_BLUE "Input image size: %ux%u, %d %s channel(s)%s%s\n" ESC_DEFAULT,
+	       f->src.w, f->src.h, f->src.n, typeNames[f->src.type], f->padded ? ", padded" : "",
+	       f->src.tile ? ", tiled" : "");
+	SpanCounters c;
+	c.bytesRead = fileSize(f->input);
+	printElapsed(ctx, f, "load", tStart, c);
+	return 0;
+}
+
+// Texels a latlong to latlong conversion of the same size shifts rows
+// by, if it only turns the source by a whole number of texels in yaw,
+// or -1 if it needs the sampler
+static int yawShift(const Context *ctx, const Image *src, const Image *dst)
+{
+	const Orientation &o = ctx->orient;
+	if (ctx->conv != findConversion("latlong", "latlong") || src->w != dst->w || src->h != dst->h ||
+	    src->tile || ctx->filter == FilterArea || ctx->order != OrderRows || o.pitch != 0. || o.roll != 0.)
+		return -1;
+	double s = o.yaw / 360. * src->w, k = floor(s + 0.5);
+	if (fabs(s - k) > 1e-3)
+		return -1;
+	k = fmod(k, src->w);
+	return k < 0. ? k + src->w : k;
+}
+
+// Render straight into the mapped output file if its rows are contiguous,
+// or into buffer otherwise, keeping it if the dimensions did not change
+static int renderFrame(Context *ctx, Frame *f, Image *buffer)
+{
+	ThreadPool *pool = &ctx->pool;
+	// The area filter footprint is not precomputed
+	Lut *lut = ctx->useLut && ctx->filter != FilterArea ? &ctx->lut : 0;
+	Image *src = &f->src, *dst = &f->dst;
+	const Kernel *kernel = ctx->kernel;
+	if (!kernel->accurate(src)) {
+		printf(ESC_YELLOW "Kernel %s exceeds half a texel of error at %ux%u, using %s\n" ESC_DEFAULT,
+		       kernel->name, src->w, src->h, ctx->conv->kernels->name);
+		kernel = ctx->conv->kernels;
+	}
+	const Orientation &orient = ctx->orient;
+	// Kernels relying on the unrotated geometry fall back to the reference,
+	// noted in the rendering line
+	char fallback[64] = "";
+	if (!orient.identity() && !kernel->rotatedRendering) {
+		snprintf(fallback, sizeof(fallback), " (%s does not rotate)", kernel->name);
+		kernel = ctx->conv->kernels;
+	}
+
+	double tStart = monotonic();
+	int w, h;
+	ctx->conv->targetSize(src, ctx->size, &w, &h);
+	// Stored dimensions, the kernels address faces through the layout
+	const bool laidOut = ctx->layout != LayoutStrip || ctx->faceOrientation != FacesNative;
+	int pw = w, ph = h;
+	if (laidOut) {
+		f->layout.build(ctx->layout, ctx->faceOrientation, h);
+		pw = f->layout.w;
+		ph = f->layout.h;
+	}
+	bool mapped = src->n == 3 && src->type == TypeU8 && !isPng(f->output) && !isHdr(f->output) &&
+		ctx->layout != LayoutFaces && f->out.create(f->output, pw, ph, true);
+	// Texels are copied as they are, so BMP output needs a BGR source
+	if (mapped && !f->out.raw)
+		src->swapRB();
+	if (mapped && OutputMap::contiguous(f->output, pw)) {
+		Image img = {pw, ph, src->n, f->out.data};
+		*dst = img;
+	} else {
+		if (!buffer->ptr || buffer->w != pw || buffer->h != ph || buffer->n != src->n ||
+		    buffer->type != src->type) {
+			free(buffer->ptr);
+			buffer->w = pw;
+			buffer->h = ph;
+			buffer->n = src->n;
+			buffer->type = src->type;
+			if (!buffer->alloc()) {
+				buffer->ptr = 0;
+				fputs(ESC_RED "Error allocating image memory\n" ESC_DEFAULT, stderr);
+				return 4;
+			}
+		}
+		*dst = *buffer;
+	}
+	if (laidOut) {
+		dst->w = w;
+		dst->h = h;
+		dst->layout = &f->layout;
+		f->layout.clearGaps(dst->ptr, dst->texel());
+	}
+	ctx->trace.span("alloc", f->input, f->output, tStart, monotonic(), SpanCounters());
+	char faces[64] = "";
+	if (laidOut)
+		snprintf(faces, sizeof(faces), ", %s layout of %s faces", layoutNames[ctx->layout],
+			 faceOrientationNames[ctx->faceOrientation]);
+	printf(ESC_BLUE "Output image size: %ux%u%s%s\n" ESC_DEFAULT, pw, ph, faces,
+	       f->out.map && dst->ptr == f->out.data ? ", mapped" : "");
+	// Cyclic shifts need neither lookup tables nor sampling
+	const int shift = yawShift(ctx, src, dst);
+	if (shift >= 0)
+		lut = 0;
+
+	if (lut && !lut->matches(kernel, src, dst, ctx->filter, orient)) {
+		char path[PATH_MAX];
+		bool ok = false;
+		tStart = monotonic();
+		if (ctx->cacheDir) {
+			Lut::cachePath(path, sizeof(path), ctx->cacheDir, ctx->conv, kernel, ctx->filter, orient, src, dst);
+			if ((ok = lut->load(path, kernel, ctx->filter, orient, src, dst))) {
+				printf(ESC_YELLOW "Mapped lookup table %s\n" ESC_DEFAULT, path);
+			} else {
+				printf(ESC_YELLOW "Building lookup table %s...\n" ESC_DEFAULT, path);
+				if (!(ok = lut->save(path, pool, kernel, ctx->filter, orient, src, dst)))
+					fputs(ESC_RED "Error creating lookup table cache file\n" ESC_DEFAULT, stderr);
+			}
+		}
+		if (!ok)
+			puts(ESC_YELLOW "Building lookup table..." ESC_DEFAULT);
+		if (!ok && !lut->build(pool, kernel, ctx->filter, orient, src, dst)) {
+			fputs(ESC_RED "Error allocating lookup table memory\n" ESC_DEFAULT, stderr);
+			return 4;
+		}
+		printElapsed(ctx, f, "lut", tStart);
+	}
+
+	if (ctx->filter == FilterArea) {
+		puts(ESC_YELLOW "Building mip pyramid..." ESC_DEFAULT);
+		tStart = monotonic();
+		if (!ctx->mip.build(pool, src)) {
+			fputs(ESC_RED "Error allocating mip pyramid memory\n" ESC_DEFAULT, stderr);
+			return 4;
+		}
+		printElapsed(ctx, f, "mip", tStart);
+	}
+
+	printf(ESC_YELLOW "Rendering %s with %d thread(s), %s kernel%s, %s filter, %s order...\n" ESC_DEFAULT,
+	       f->input, pool->threads(),
+	       lut ? "lookup table" : shift >= 0 ? "shift" :
+	       ctx->filter == FilterArea || ctx->order != OrderRows ? "reference" : kernel->name,
+	       shift >= 0 ? "" : fallback, filterNames[ctx->filter], orderNames[ctx->order]);
+	tStart = monotonic();
+	const Filter filter = ctx->filter;
+	if (shift >= 0) {
+		parallel_rows(pool, dst->h, [&](int v0, int v1) {
+			shift_rendering(src, dst, shift, v0, v1);
+		});
+	} else if (filter == FilterArea) {
+		const Mipmap *mip = &ctx->mip;
+		void (*const rendering)(const Mipmap *, Image *, int, int) = ctx->conv->areaRendering;
+		parallel_rows(pool, dst->h, [&](int v0, int v1) {
+			rendering(mip, dst, v0, v1);
+		});
+	} else if (lut) {
+		const void *data = lut->data;
+		parallel_rows(pool, dst->h, [&](int v0, int v1) {
+			lut_rendering(src, dst, filter, data, v0, v1);
+		});
+	} else if (ctx->order != OrderRows) {
+		const Conversion *conv = ctx->conv;
+		const int s = dst->w / conv->targetFaces;
+		const size_t texel = dst->texel();
+		std::vector<Tile> tiles;
+		order_tiles(ctx->order, conv->targetFaces, s, dst->h, &tiles);
+		const Tile *t = tiles.data();
+		pool->run(tiles.size(), [&](int i) {
+			uint8_t *out = (uint8_t *)dst->ptr + ((size_t)t[i].v0 * dst->w + t[i].face * s + t[i].u0) * texel;
+			conv->tileRendering(src, dst, filter, t[i], out, dst->w * texel);
+		});
+	} else {
+		parallel_rows(pool, dst->h, [&](int v0, int v1) {
+			kernel->render(src, dst, filter, orient, v0, v1);
+		});
+	}
+	puts(ESC_GREEN "Rendering finished." ESC_DEFAULT);
+	SpanCounters c;
+	c.texels = (long long)dst->w * dst->h;
+	long long *misses = c.misses;
+	misses[0] = misses[1] = 0;
+	for (int i = 0; i != pool->threads(); i++)
+		for (int k = 0; k != 2; k++)
+			misses[k] = misses[k] < 0 || pool->stat(i).misses[k] < 0 ? -1 : misses[k] + pool->stat(i).misses[k];
+	printElapsed(ctx, f, "render", tStart, c);
+	for (int i = 0; i != pool->threads(); i++) {
+		const ThreadPool::Stats &st = pool->stat(i);
+		printf(ESC_GREY "Thread %d: %d task(s), busy %ld.%06ld\n" ESC_DEFAULT,
+		       i, st.tasks, st.busy.tv_sec, st.busy.tv_usec);
+	}
+	const double texels = c.texels;
+	if (misses[0] >= 0 || misses[1] >= 0)
+		printf(ESC_BLUE "Cache misses: L1D %lld (%.3f per texel), LLC %lld (%.3f per texel)\n" ESC_DEFAULT,
+		       misses[0], misses[0] / texels, misses[1], misses[1] / texels);
+	else
+		puts(ESC_GREY "Cache misses: not counted on this system" ESC_DEFAULT);
+
+	const void *idx = lut && lut->filter == FilterNearest ? lut->data : 0;
+	if (ctx->verify && !verify(pool, ctx->conv, kernel, ctx->filter, orient, src, dst, (const uint32_t *)idx))
+		fputs(ESC_RED "Error allocating verification memory\n" ESC_DEFAULT, stderr);
+	// Sources are read as strips of native faces
+	if (ctx->roundTrip && laidOut)
+		puts(ESC_YELLOW "Round trip skipped, the output is not a strip of native faces" ESC_DEFAULT);
+	else if (ctx->roundTrip)
+		roundTrip(pool, ctx->conv, kernel, ctx->filter, orient, src, dst);
+	return 0;
+}
+
+// Write img to path in the format of its extension, other than mapped
+static bool writeImage(Context *ctx, const char *path, const Image *img)
+{
+	if (isHdr(path))
+		return stbi_write_hdr(path, img->w, img->h, img->n, (const float *)img->ptr);
+	if (isPng(path))
+		return writePng(&ctx->encoders, path, img, ctx->pngLevel);
+	if (OutputMap::isRaw(path)) {
+		FILE *fp = fopen(path, "wb");
+		bool ok = fp && fwrite(img->ptr, img->bytes(), 1, fp) == 1;
+		return fp && fclose(fp) == 0 && ok;
+	}
+	return stbi_write_bmp(path, img->w, img->h, img->n, img->ptr);
+}
+
+// File name suffixes of the faces saved separately, see LayoutFaces
+static const char *const faceSuffixes[6] = {"_px", "_nx", "_py", "_ny", "_pz", "_nz"};
+
+static int saveFrame(Context *ctx, Frame *f)
+{
+	// Texels as stored, faces and the gaps around them
+	Image stored = f->dst;
+	if (stored.layout) {
+		stored.w = stored.layout->w;
+		stored.h = stored.layout->h;
+		stored.layout = 0;
+	}
+	const Image *dst = &stored;
+	printf(ESC_YELLOW "Saving output image %s...\n" ESC_DEFAULT, f->output);
+	double tStart = monotonic();
+	// Formats other than Radiance HDR and 16-bit PNG take 8-bit texels, BMP
+	// takes RGB, the others keep grey and alpha
+	const bool hdr = isHdr(f->output), png = isPng(f->output), bmp = !hdr && !png && !OutputMap::isRaw(f->output);
+	Type type = hdr ? TypeFloat : png && dst->type == TypeU16 ? TypeU16 : TypeU8;
+	int n = f->padded || bmp ? 3 : dst->n;
+	Image tmp = {0, 0, 0, 0};
+	if (dst->type != type || dst->n != n) {
+		if (!convert_image(&ctx->encoders, dst, &tmp, type, n)) {
+			fputs(ESC_RED "Error allocating image memory\n" ESC_DEFAULT, stderr);
+			return 4;
+		}
+		dst = &tmp;
+	}
+	bool ok = true;
+	long long written = 0;
+	// The kernel writes mapped pages back, rows needing padding are copied
+	if (f->out.map) {
+		if (dst->ptr != f->out.data)
+			for (int v = 0; v != dst->h; v++)
+				memcpy(f->out.row(v), (uint8_t *)dst->ptr + (size_t)v * dst->w * 3, (size_t)dst->w * 3);
+		f->out.close();
+	} else if (ctx->layout == LayoutFaces) {
+		// Faces are consecutive squares of the column, saved in place
+		const char *ext = strrchr(f->output, '.');
+		if (!ext || strchr(ext, '/'))
+			ext = f->output + strlen(f->output);
+		for (int i = 0; ok && i != 6; i++) {
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%.*s%s%s", (int)(ext - f->output), f->output, faceSuffixes[i], ext);
+			Image face = *dst;
+			face.h = dst->w;
+			face.ptr = (uint8_t *)dst->ptr + (size_t)i * dst->w * dst->w * dst->texel();
+			ok = writeImage(ctx, path, &face);
+			written += fileSize(path);
+		}
+	} else {
+		ok = writeImage(ctx, f->output, dst);
+	}
+	free(tmp.ptr);
+	if (!ok) {
+		fprintf(stderr, ESC_RED "Error saving output image %s\n" ESC_DEFAULT, f->output);
+		return 3;
+	}
+	SpanCounters c;
+	c.bytesWritten = ctx->layout == LayoutFaces ? written : fileSize(f->output);
+	printElapsed(ctx, f, "save", tStart, c);
+	return 0;
+}
+
+// Smallest and largest tile size tried, the largest one whose tiles fit
+// the memory limit is used
+static const int streamTileMax = 256, streamTileMin = 32;
+
+// Convert a source larger than the memory limit: the source is read once
+// from top to bottom into a window of rows, and every tile is rendered
+// as soon as all of its source rows are in the window, straight into the
+// memory mapped output. Half of the limit goes to the window, the other
+// half to output pages written between flushes.
+static int streamFrame(Context *ctx, Frame *f)
+{
+	ThreadPool *pool = &ctx->pool;
+	const Conversion *conv = ctx->conv;
+	const Filter filter = ctx->filter;
+
+	printf(ESC_YELLOW "Streaming %s with %d thread(s), %s filter...\n" ESC_DEFAULT,
+	       f->input, pool->threads(), filterNames[filter]);
+	double tStart = monotonic();
+	if (filter == FilterArea) {
+		fputs(ESC_RED "The area filter needs the whole source in memory\n" ESC_DEFAULT, stderr);
+		return 4;
+	}
+	if (isPng(f->output) || isHdr(f->output)) {
+		fprintf(stderr, ESC_RED "Streamed output must be BMP or raw, %s is not\n" ESC_DEFAULT, f->output);
+		return 3;
+	}
+	PpmReader in;
+	if (!in.open(f->input)) {
+		fprintf(stderr, ESC_RED "Streamed conversion needs a binary PPM input, %s is not\n" ESC_DEFAULT, f->input);
+		return 2;
+	}
+	Image src = {in.w, in.h, 3, 0}, dst = {0, 0, 3, 0};
+	if (!conv->accepts(&src)) {
+		fprintf(stderr, ESC_RED "Invalid %s input image size\n" ESC_DEFAULT, conv->source);
+		return 2;
+	}
+	conv->targetSize(&src, ctx->size, &dst.w, &dst.h);
+	printf(ESC_BLUE "Output image size: %ux%u\n" ESC_DEFAULT, dst.w, dst.h);
+
+	const size_t rowSize = (size_t)src.w * 3;
+	const int s = dst.w / conv->targetFaces;
+	std::vector<Tile> tiles;
+	int rows = 0;
+	for (int size = streamTileMax; ; size /= 2) {
+		tiles.clear();
+		for (int face = 0; face != conv->targetFaces; face++)
+			for (int v = 0; v < dst.h; v += size)
+				for (int u = 0; u < s; u += size)
+					tiles.push_back(Tile{face, u, v, std::min(u + size, s), std::min(v + size, dst.h), 0, 0});
+		Tile *t = tiles.data();
+		pool->run(tiles.size(), [=, &src, &dst](int i) {
+			conv->tileRows(&src, &dst, filter, &t[i]);
+		});
+		int span = 0;
+		for (const Tile &t: tiles)
+			span = std::max(span, t.hi - t.lo + 1);
+		size_t used = tiles.size() * sizeof(Tile) + ctx->maxMemory / 2;
+		rows = ctx->maxMemory > used ? std::min<size_t>((ctx->maxMemory - used) / rowSize, src.h) : 0;
+		if (span <= rows)
+			break;
+		if (size == streamTileMin) {
+			fputs(ESC_RED "Memory limit too low for a streamed conversion\n" ESC_DEFAULT, stderr);
+			return 4;
+		}
+	}
+	std::sort(tiles.begin(), tiles.end(), [](const Tile &a, const Tile &b) { return a.lo < b.lo; });
+
+	uint8_t *buf = (uint8_t *)malloc(rows * rowSize + 4);
+	OutputMap out;
+	if (!buf) {
+		fputs(ESC_RED "Error allocating image memory\n" ESC_DEFAULT, stderr);
+		return 4;
+	}
+	if (!out.create(f->output, dst.w, dst.h, false)) {
+		fprintf(stderr, ESC_RED "Error saving output image %s\n" ESC_DEFAULT, f->output);
+		free(buf);
+		return 3;
+	}
+
+	// Source rows [a, b) are in buf
+	int a = 0, b = 0, ret = 0;
+	long long rowsRead = 0;
+	const size_t page = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0, j; ret == 0 && i != tiles.size(); i = j) {
+		int lo = tiles[i].lo;
+		if (lo > a) {
+			if (lo < b)
+				memmove(buf, buf + (lo - a) * rowSize, (b - lo) * rowSize);
+			else if (!in.skip(lo - b))
+				ret = 2;
+			a = lo;
+			b = std::max(b, lo);
+		}
+		int end = std::min(a + rows, src.h);
+		if (ret == 0 && b != end && !in.read(buf + (b - a) * rowSize, end - b))
+			ret = 2;
+		rowsRead += end - b;
+		b = end;
+		// Output pages touched by the tiles up to the next flush
+		size_t pages = 0;
+		for (j = i; j != tiles.size() && tiles[j].hi < b; j++) {
+			const Tile &t = tiles[j];
+			pages += (size_t)(t.v1 - t.v0) * (((t.u1 - t.u0) * 3 + page - 1) / page + 1) * page;
+			if (j != i && pages > ctx->maxMemory / 2)
+				break;
+		}
+
+		// Rows outside the window are never read
+		Image win = src;
+		win.ptr = buf - (size_t)a * rowSize;
+		const Tile *t = &tiles[i];
+		pool->run(j - i, [&, t](int k) {
+			const Tile &tile = t[k];
+			uint8_t *p = out.row(tile.v0) + (size_t)(tile.face * s + tile.u0) * 3;
+			ptrdiff_t stride = out.topDown ? out.stride : -out.stride;
+			conv->tileRendering(&win, &dst, filter, tile, p, stride);
+			// BMP stores BGR
+			for (int v = tile.v0; !out.raw && v != tile.v1; v++, p += stride)
+				for (int u = 0; u != tile.u1 - tile.u0; u++)
+					std::swap(p[u * 3], p[u * 3 + 2]);
+		});
+		out.flush();
+	}
+	free(buf);
+	if (ret) {
+		fprintf(stderr, ESC_RED "Error reading input image %s\n" ESC_DEFAULT, f->input);
+		return ret;
+	}
+	puts(ESC_GREEN "Streaming finished." ESC_DEFAULT);
+	SpanCounters c;
+	c.bytesRead = rowsRead * rowSize;
+	c.bytesWritten = fileSize(f->output);
+	c.texels = (long long)dst.w * dst.h;
+	printElapsed(ctx, f, "stream", tStart, c);
+	return 0;
+}
+
+// Memory for converting the image at path in one go, 0 if unknown
+static size_t frameMemory(Context *ctx, const char *path)
+{
+	Image src = {0, 0, 3, 0}, dst = {0, 0, 3, 0};
+	if (!stbi_info(path, &src.w, &src.h, &src.n))
+		return 0;
+	src.n = dst.n = src.n == 1 ? 1 : src.n == 3 && !ctx->rgbx ? 3 : 4;
+	src.type = dst.type = ctx->precision != TypeCount ? ctx->precision : Image::fileType(path);
+	ctx->conv->targetSize(&src, ctx->size, &dst.w, &dst.h);
+	size_t size = src.bytes() + dst.bytes();
+	if (ctx->filter == FilterArea)
+		size += src.bytes() / 3;
+	else if (ctx->useLut)
+		size += (size_t)dst.w * dst.h * (ctx->filter == FilterNearest ? sizeof(uint32_t) : sizeof(Image::Coord));
+	return size;
+}
+
+// Output buffers cycling between rendering and saving
+static const int pipelineBuffers = 2;
+
+// Load frame N + 1, render frame N on the thread pool and save frame
+// N - 1 at the same time, or convert frames one by one with a memory
+// limit. Stages are connected by queues holding a single
+// frame, so at most three sources and two outputs are in memory.
+static int convert(Context *ctx, std::vector<Frame> &frames)
+{
+	// One frame at a time with a memory limit, streaming the ones over it
+	if (ctx->maxMemory) {
+		Image img = {0, 0, 0, 0};
+		for (Frame &f: frames) {
+			int ret;
+			if (frameMemory(ctx, f.input) > ctx->maxMemory) {
+				ret = streamFrame(ctx, &f);
+			} else if (!(ret = loadFrame(ctx, &f))) {
+				if (!(ret = renderFrame(ctx, &f, &img)))
+					ret = saveFrame(ctx, &f);
+				f.out.close();
+				stbi_image_free(f.src.ptr);
+			}
+			if (ret) {
+				ctx->fail(ret);
+				break;
+			}
+		}
+		free(img.ptr);
+		return ctx->status;
+	}
+
+	Queue<Frame *> loaded(1), rendered(1);
+	Queue<Image *> buffers(pipelineBuffers);
+	Image images[pipelineBuffers];
+	for (Image &img: images) {
+		img = Image();
+		buffers.push(&img);
+	}
+
+	std::thread loader([&]() {
+		for (Frame &f: frames) {
+			if (ctx->status)
+				break;
+			int ret = loadFrame(ctx, &f);
+			if (ret) {
+				ctx->fail(ret);
+				break;
+			}
+			loaded.push(&f);
+		}
+		loaded.close();
+	});
+	std::thread saver([&]() {
+		for (Frame *f; rendered.pop(&f);) {
+			int ret = ctx->status ? 0 : saveFrame(ctx, f);
+			if (ret)
+				ctx->fail(ret);
+			f->out.close();
+			buffers.push(f->buffer);
+		}
+	});
+
+	for (Frame *f; loaded.pop(&f);) {
+		if (!ctx->status) {
+			buffers.pop(&f->buffer);
+			int ret = renderFrame(ctx, f, f->buffer);
+			if (ret) {
+				ctx->fail(ret);
+				f->out.close();
+				buffers.push(f->buffer);
+			} else {
+				rendered.push(f);
+			}
+		}
+		stbi_image_free(f->src.ptr);
+	}
+	rendered.close();
+	loader.join();
+	saver.join();
+
+	for (Image &img: images)
+		free(img.ptr);
+	return ctx->status;
+}
+
+// Fill rows [v0, v1) of a synthetic source: smooth waves with a little
+// hashed noise per component, so that every filter has detail to blend
+static void synthesize(Image *img, int v0, int v1)
+{
+	with_component(img->type, [=](auto t) {
+		typedef decltype(t) T;
+		typedef Component<T> C;
+		T *p = (T *)img->ptr + (size_t)v0 * img->w * img->n;
+		for (int v = v0; v != v1; v++)
+			for (int u = 0; u != img->w; u++)
+				for (int k = 0; k != img->n; k++) {
+					uint32_t x = ((uint32_t)v * img->w + u) * 4 + k;
+					x = (x ^ x >> 16) * 0x7feb352d;
+					x = (x ^ x >> 15) * 0x846ca68b;
+					float f = 0.5f + 0.3f * sinf(u * 0.05f + k) * cosf(v * 0.03f) + (x >> 24) / 2560.f;
+					*p++ = C::round(f * C::scale);
+				}
+	});
+}
+
+// Render mode timed by the benchmark
+struct BenchMode
+{
+	const Kernel *kernel;
+	bool lut;
+	Filter filter;
+	// Traversal of the reference mapping tiles, rows for kernels
+	Order order;
+};
+
+struct BenchResult
+{
+	const char *mode;
+	Filter filter;
+	Order order;
+	// Seconds per iteration
+	double min, median, p99;
+	// Per target texel, negative if not counted
+	double misses[2];
+};
+
+// Time every supported kernel with the nearest, bilinear and bicubic
+// filters it renders natively, see Kernel::native, lookup tables of the fastest kernel and the area filter,
+// rendering a synthetic source height texels high. With --order or
+// --tiled-source, every traversal order other than rows is timed too on
+// the reference mapping, from the tiled source if asked, to compare
+// their cache misses. Lookup tables and the mip pyramid are built before
+// timing, and the first run of every mode is not timed. Results go to
+// json if given, - for standard output.
+static int bench(Context *ctx, int height, int iterations, const char *json)
+{
+	ThreadPool *pool = &ctx->pool;
+	const Conversion *conv = ctx->conv;
+	const int faces = conv->sourceFaces;
+	Image src = {faces == 1 ? height * 2 : height * faces, height, ctx->rgbx ? 4 : 3, 0,
+		     ctx->precision != TypeCount ? ctx->precision : TypeU8};
+	Image dst = src;
+	conv->targetSize(&src, ctx->size, &dst.w, &dst.h);
+	if (!src.alloc() || !dst.alloc()) {
+		free(src.ptr);
+		fputs(ESC_RED "Error allocating image memory\n" ESC_DEFAULT, stderr);
+		return 4;
+	}
+	parallel_rows(pool, src.h, [&](int v0, int v1) { synthesize(&src, v0, v1); });
+	// Source of the traversal orders
+	Image tiled = {0, 0, 0, 0};
+	if (ctx->tiledSource && !tile_image(pool, &src, &tiled, sourceTile)) {
+		free(src.ptr);
+		free(dst.ptr);
+		fputs(ESC_RED "Error allocating image memory\n" ESC_DEFAULT, stderr);
+		return 4;
+	}
+	const Image *orderSrc = ctx->tiledSource ? &tiled : &src;
+	// Standard output is left to JSON results
+	FILE *log = json && strcmp(json, "-") == 0 ? stderr : stdout;
+	fprintf(log, ESC_YELLOW "Benchmark %s %ux%u -> %s %ux%u, %d %s channel(s), %d thread(s), %d iteration(s)%s\n"
+		ESC_DEFAULT, conv->source, src.w, src.h, conv->target, dst.w, dst.h, src.n, typeNames[src.type],
+		pool->threads(), iterations, ctx->tiledSource ? ", tiled source for traversal orders" : "");
+
+	std::vector<BenchMode> modes;
+	for (int i = 0; i != conv->kernelCount; i++) {
+		const Kernel *k = &conv->kernels[i];
+		if (!k->supported || k->supported())
+			for (int f = FilterNearest; f != FilterArea; f++)
+				if (!k->native || k->native(&src, (Filter)f))
+					modes.push_back(BenchMode{k, false, (Filter)f, OrderRows});
+	}
+	for (int f = FilterNearest; f != FilterArea; f++)
+		modes.push_back(BenchMode{ctx->kernel, true, (Filter)f, OrderRows});
+	modes.push_back(BenchMode{conv->kernels, false, FilterArea, OrderRows});
+	if (ctx->order != OrderRows || ctx->tiledSource)
+		for (int o = OrderFaces; o != OrderCount; o++)
+			for (int f = FilterNearest; f != FilterArea; f++)
+				modes.push_back(BenchMode{conv->kernels, false, (Filter)f, (Order)o});
+
+	std::vector<BenchResult> results;
+	std::vector<double> times(iterations);
+	const double texels = (double)dst.w * dst.h;
+	int ret = 0;
+	const int s = dst.w / conv->targetFaces;
+	const size_t texel = dst.texel();
+	std::vector<Tile> tiles;
+	for (const BenchMode &m: modes) {
+		Lut lut;
+		if (m.order != OrderRows)
+			order_tiles(m.order, conv->targetFaces, s, dst.h, &tiles);
+		if ((m.lut && !lut.build(pool, m.kernel, m.filter, Orientation(), &src, &dst)) ||
+		    (m.filter == FilterArea && !ctx->mip.build(pool, &src))) {
+			fputs(ESC_RED "Error allocating benchmark memory\n" ESC_DEFAULT, stderr);
+			ret = 4;
+			break;
+		}
+		const char *mode = m.lut ? "lookup table" : m.order != OrderRows ? orderNames[m.order] : m.kernel->name;
+		BenchResult r = {mode, m.filter, m.order, 0., 0., 0., {0., 0.}};
+		for (int i = -1; i != iterations; i++) {
+			double t = monotonic();
+			if (m.order != OrderRows) {
+				const Tile *tl = tiles.data();
+				pool->run(tiles.size(), [&](int j) {
+					uint8_t *out = (uint8_t *)dst.ptr + ((size_t)tl[j].v0 * dst.w + tl[j].face * s + tl[j].u0) * texel;
+					conv->tileRendering(orderSrc, &dst, m.filter, tl[j], out, dst.w * texel);
+				});
+			} else {
+				parallel_rows(pool, dst.h, [&](int v0, int v1) {
+					if (m.filter == FilterArea)
+						conv->areaRendering(&ctx->mip, &dst, v0, v1);
+					else if (m.lut)
+						lut_rendering(&src, &dst, m.filter, lut.data, v0, v1);
+					else
+						m.kernel->rendering(&src, &dst, m.filter, v0, v1);
+				});
+			}
+			if (i < 0)
+				continue;
+			times[i] = monotonic() - t;
+			for (int j = 0; j != pool->threads(); j++)
+				for (int k = 0; k != 2; k++) {
+					long long n = pool->stat(j).misses[k];
+					r.misses[k] = r.misses[k] < 0 || n < 0 ? -1. : r.misses[k] + n / texels / iterations;
+				}
+		}
+		std::sort(times.begin(), times.end());
+		r.min = times[0];
+		r.median = iterations % 2 ? times[iterations / 2] : (times[iterations / 2 - 1] + times[iterations / 2]) / 2.;
+		r.p99 = times[(int)ceil(iterations * 0.99) - 1];
+		fprintf(log, ESC_BLUE "  %-12s %-8s %9.2f MP/s, min %.3f ms, median %.3f ms, p99 %.3f ms" ESC_DEFAULT,
+		       r.mode, filterNames[r.filter], texels / r.median / 1e6, r.min * 1e3, r.median * 1e3, r.p99 * 1e3);
+		if (r.misses[0] >= 0. || r.misses[1] >= 0.)
+			fprintf(log, ESC_GREY ", misses per texel L1D %.3f, LLC %.3f" ESC_DEFAULT, r.misses[0], r.misses[1]);
+		fputc('\n', log);
+		results.push_back(r);
+	}
+	free(src.ptr);
+	free(tiled.ptr);
+	free(dst.ptr);
+
+	FILE *fp = !json || ret ? 0 : strcmp(json, "-") == 0 ? stdout : fopen(json, "w");
+	if (json && !ret && !fp) {
+		fprintf(stderr, ESC_RED "Error saving benchmark results %s\n" ESC_DEFAULT, json);
+		return 3;
+	}
+	if (!fp)
+		return ret;
+	fprintf(fp, "{\"source\": \"%s\", \"target\": \"%s\", \"source_size\": [%d, %d], \"target_size\": [%d, %d],\n"
+		" \"type\": \"%s\", \"channels\": %d, \"threads\": %d, \"iterations\": %d, \"tiled_source\": %s,\n"
+		" \"results\": [\n",
+		conv->source, conv->target, src.w, src.h, dst.w, dst.h, typeNames[src.type], src.n,
+		pool->threads(), iterations, ctx->tiledSource ? "true" : "false");
+	for (size_t i = 0; i != results.size(); i++) {
+		const BenchResult &r = results[i];
+		fprintf(fp, "  {\"mode\": \"%s\", \"filter\": \"%s\", \"order\": \"%s\", \"mpixels_per_s\": %.3f, "
+			"\"min_ms\": %.4f, \"median_ms\": %.4f, \"p99_ms\": %.4f", r.mode, filterNames[r.filter],
+			orderNames[r.order], texels / r.median / 1e6, r.min * 1e3, r.median * 1e3, r.p99 * 1e3);
+		static const char *const names[2] = {"l1d_misses_per_texel", "llc_misses_per_texel"};
+		for (int k = 0; k != 2; k++)
+			if (r.misses[k] >= 0.)
+				fprintf(fp, ", \"%s\": %.4f", names[k], r.misses[k]);
+			else
+				fprintf(fp, ", \"%s\": null", names[k]);
+		fprintf(fp, "}%s\n", i + 1 != results.size() ? "," : "");
+	}
+	fputs("]}\n", fp);
+	if (fp != stdout && fclose(fp) != 0) {
+		fprintf(stderr, ESC_RED "Error saving benchmark results %s\n" ESC_DEFAULT, json);
+		return 3;
+	}
+	return 0;
+}
+
+// Add INPUT OUTPUT pairs from a list file, one per line, - for stdin
+static bool readList(const char *path, std::vector<Frame> &frames, std::vector<char *> &names)
+{
+	FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (!fp)
+		return false;
+	char *line = 0;
+	size_t size = 0;
+	bool ok = true;
+	for (int n = 1; ok && getline(&line, &size, fp) >= 0; n++) {
+		// Whitespace separated INPUT and OUTPUT, anything after is ignored
+		char *tok[2], *p = line;
+		int k = 0;
+		if (line[0] == '#')
+			continue;
+		for (; k != 2; k++) {
+			p += strspn(p, " \t\r\n");
+			size_t len = strcspn(p, " \t\r\n");
+			if (!len)
+				break;
+			if (len >= PATH_MAX) {
+				fprintf(stderr, ESC_RED "Path too long on line %d of batch list %s\n" ESC_DEFAULT, n, path);
+				ok = false;
+				break;
+			}
+			tok[k] = p;
+			p += len;
+			if (*p)
+				*p++ = 0;
+		}
+		if (!ok || k != 2)
+			continue;
+		names.push_back(strdup(tok[0]));
+		names.push_back(strdup(tok[1]));
+		frames.push_back(Frame{names[names.size() - 2], names.back(), Image(), 0, Image(), OutputMap(), false, FaceLayout()});
+	}
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return ok;
+}
+
+// Add every file matching pattern, saved as DIR/NAME.bmp
+static bool readGlob(const char *pattern, const char *dir, std::vector<Frame> &frames, std::vector<char *> &names)
+{
+	glob_t g;
+	if (glob(pattern, 0, 0, &g) != 0)
+		return false;
+	for (size_t i = 0; i != g.gl_pathc; i++) {
+		char *in = strdup(g.gl_pathv[i]), *base = strdup(g.gl_pathv[i]);
+		char out[PATH_MAX], *name = basename(base), *ext = strrchr(name, '.');
+		if (ext && ext != name)
+			*ext = 0;
+		snprintf(out, sizeof(out), "%s/%s.bmp", dir, name);
+		free(base);
+		names.push_back(in);
+		names.push_back(strdup(out));
+		frames.push_back(Frame{in, names.back(), Image(), 0, Image(), OutputMap(), false, FaceLayout()});
+	}
+	globfree(&g);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	enum {OptVerify = 0x100, OptRoundTrip, OptSource, OptTarget, OptRgbx, OptOrder, OptTiledSource,
+	      OptBench, OptIterations, OptJson, OptTrace, OptTraceFormat, OptYaw, OptPitch, OptRoll,
+	      OptLayout, OptFaceOrientation};
+	static const struct option options[] = {
+		{"jobs", required_argument, 0, 'j'},
+		{"source", required_argument, 0, OptSource},
+		{"target", required_argument, 0, OptTarget},
+		{"layout", required_argument, 0, OptLayout},
+		{"face-orientation", required_argument, 0, OptFaceOrientation},
+		{"yaw", required_argument, 0, OptYaw},
+		{"pitch", required_argument, 0, OptPitch},
+		{"roll", required_argument, 0, OptRoll},
+		{"kernel", required_argument, 0, 'k'},
+		{"filter", required_argument, 0, 'f'},
+		{"size", required_argument, 0, 's'},
+		{"batch", required_argument, 0, 'b'},
+		{"glob", required_argument, 0, 'g'},
+		{"output-dir", required_argument, 0, 'o'},
+		{"max-memory", required_argument, 0, 'm'},
+		{"png-level", required_argument, 0, 'z'},
+		{"precision", required_argument, 0, 'p'},
+		{"rgbx", no_argument, 0, OptRgbx},
+		{"order", required_argument, 0, OptOrder},
+		{"tiled-source", no_argument, 0, OptTiledSource},
+		{"lut", no_argument, 0, 'l'},
+		{"lut-cache", required_argument, 0, 'c'},
+		{"verify", no_argument, 0, OptVerify},
+		{"round-trip", no_argument, 0, OptRoundTrip},
+		{"bench", required_argument, 0, OptBench},
+		{"iterations", required_argument, 0, OptIterations},
+		{"json", required_argument, 0, OptJson},
+		{"trace", required_argument, 0, OptTrace},
+		{"trace-format", required_argument, 0, OptTraceFormat},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	Context ctx;
+	int jobs = std::thread::hardware_concurrency();
+	const char *source = defaultSource, *target = defaultTarget, *kernel = defaultKernel;
+	const char *outputDir = ".", *json = 0, *trace = 0;
+	Trace::Format traceFormat = Trace::FormatLines;
+	int benchHeight = 0, iterations = 10;
+	float yaw = 0., pitch = 0., roll = 0.;
+	std::vector<const char *> lists, globs;
+	for (int c; (c = getopt_long(argc, argv, "j:k:f:s:b:g:o:m:z:p:lc:h", options, 0)) != -1;) {
+		switch (c) {
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				fputs(ESC_RED "Invalid number of jobs\n" ESC_DEFAULT, stderr);
+				return 1;
+			}
+			break;
+		case OptSource:
+			source = optarg;
+			break;
+		case OptTarget:
+			target = optarg;
+			break;
+		case 'k':
+			kernel = optarg;
+			break;
+		case 'f':
+			ctx.filter = FilterCount;
+			for (int f = 0; f != FilterCount; f++)
+				if (strcmp(filterNames[f], optarg) == 0)
+					ctx.filter = (Filter)f;
+			if (ctx.filter == FilterCount) {
+				fputs(ESC_RED "Unknown filter\n" ESC_DEFAULT, stderr);
+				return 1;
+			}
+			break;
+		case 's':
+			ctx.size = atoi(optarg);
+			if (ctx.size < 1) {
+				fputs(ESC_RED "Invalid face size\n" ESC_DEFAULT, stderr);
+				return 1;
+			}
+			break;
+		case 'b':
+			lists.push_back(optarg);
+			break;
+		case 'g':
+			globs.push_back(optarg);
+			break;
+		case 'o':
+			outputDir = optarg;
+			break;
+		case 'm':
+			if (atoi(optarg) < 1) {
+				fputs(ESC_RED "Invalid memory limit\n" ESC_DEFAULT, stderr);
+				return 1;
+			}
+			ctx.maxMemory = (size_t)atoi(optarg) << 20;
+			break;
+		case 'z':
+			ctx.pngLevel = atoi(optarg);
+			if (!isdigit(*optarg) || ctx.pngLevel > 9) {
+				fputs(ESC_RED "Invalid PNG compression level\n" ESC_DEFAULT, stderr);
+				return 1;
+			}
+			break;
+		case 'p':
+			ctx.precision = TypeCount;
+			for (int t = 0; t != TypeCount; t++)
+				if (strcmp(typeNames[t], optarg) == 0)
+					ctx.precision = (Type)t;
+			if (ctx.precision == TypeCount) {
+				fputs(ESC_RED "Unknown precision\n" ESC_DEFAULT, stderr);
+				return 1;
+			}
+			break;
+		case OptRgbx:
+			ctx.rgbx = true;
+			break;
+		case OptYaw:
+			yaw = atof(optarg);
+			break;
+		case OptPitch:
+			pitch = atof(optarg);
+			break;
+		case OptRoll:
+			roll = atof(optarg);
+			break;
+		case OptLayout:
+			ctx.layout = LayoutCount;
+			for (int l = 0; l != LayoutCount; l++)
+				if (strcmp(layoutNames[l], optarg) == 0)
+					ctx.layout = (Layout)l;
+			if (ctx.layout == LayoutCount) {
+				fputs(ESC_RED "Unknown face layout\n" ESC_DEFAULT, stderr);
+				return 1;
+			}
+			break;
+		case OptFaceOrientation:
+			ctx.faceOrientation = FaceOrientationCount;
+			for (int o = 0; o != FaceOrientationCount; o++)
+				if (strcmp(faceOrientationNames[o], optarg) == 0)
+					ctx.faceOrientation = (FaceOrientation)o;
+			if (ctx.faceOrientation == FaceOrientationCount) {
+				fputs(ESC_RED "Unknown face orientation\n" ESC_DEFAULT, stderr);
+				return 1;
+			}
+			break;
+		case OptOrder:
+			ctx.order = OrderCount;
+			for (int o = 0; o != OrderCount; o++)
+				if (strcmp(orderNames[o], optarg) == 0)
+					ctx.order = (Order)o;
+			if (ctx.order == OrderCount) {
+				fputs(ESC_RED "Unknown traversal order\n" ESC_DEFAULT, stderr);
+				return 1;
+			}
+			break;
+		case OptTiledSource:
+			ctx.tiledSource = true;
+			break;
+		case 'l':
+			ctx.useLut = true;
+			break;
+		case 'c':
+			ctx.useLut = true;
+			ctx.cacheDir = optarg;
+			break;
+		case OptVerify:
+			ctx.verify = true;
+			break;
+		case OptRoundTrip:
+			ctx.roundTrip = true;
+			break;
+		case OptBench:
+			benchHeight = atoi(optarg);
+			if (benchHeight < 1) {
+				fputs(ESC_RED "Invalid benchmark source height\n" ESC_DEFAULT, stderr);
+				return 1;
+			}
+			break;
+		case OptIterations:
+			iterations = atoi(optarg);
+			if (iterations < 1) {
+				fputs(ESC_RED "Invalid number of iterations\n" ESC_DEFAULT, stderr);
+				return 1;
+			}
+			break;
+		case OptJson:
+			json = optarg;
+			break;
+		case OptTrace:
+			trace = optarg;
+			break;
+		case OptTraceFormat:
+			traceFormat = Trace::FormatCount;
+			for (int t = 0; t != Trace::FormatCount; t++)
+				if (strcmp(traceFormats[t], optarg) == 0)
+					traceFormat = (Trace::Format)t;
+			if (traceFormat == Trace::FormatCount) {
+				fputs(ESC_RED "Unknown trace format\n" ESC_DEFAULT, stderr);
+				return 1;
+			}
+			break;
+		default:
+			help();
+			return 1;
+		}
+	}
+	if ((argc - optind) % 2 || (argc == optind && lists.empty() && globs.empty() && !benchHeight)) {
+		help();
+		return 1;
+	}
+	if (!(ctx.conv = findConversion(source, target))) {
+		fputs(ESC_RED "Unsupported projections\n" ESC_DEFAULT, stderr);
+		return 1;
+	}
+	if (!(ctx.kernel = ctx.conv->findKernel(kernel))) {
+		fputs(ESC_RED "Unknown kernel\n" ESC_DEFAULT, stderr);
+		return 1;
+	}
+	if (ctx.kernel->supported && !ctx.kernel->supported()) {
+		fputs(ESC_RED "Kernel not supported by this CPU\n" ESC_DEFAULT, stderr);
+		return 1;
+	}
+	// Kernels, lookup tables and mip pyramids read sources in rows
+	if (ctx.tiledSource && ctx.order == OrderRows)
+		ctx.order = OrderTiles;
+	if (ctx.order != OrderRows && (ctx.useLut || ctx.filter == FilterArea)) {
+		fputs(ESC_RED "Traversal orders do not apply to lookup tables or the area filter\n" ESC_DEFAULT, stderr);
+		return 1;
+	}
+	ctx.orient = Orientation(yaw, pitch, roll);
+	if (!ctx.orient.identity() && (ctx.order != OrderRows || ctx.filter == FilterArea || ctx.maxMemory)) {
+		fputs(ESC_RED "Rotations do not apply to traversal orders, the area filter or streaming\n" ESC_DEFAULT,
+		      stderr);
+		return 1;
+	}
+	// Tiles and streamed strips are written in strip order
+	if ((ctx.layout != LayoutStrip || ctx.faceOrientation != FacesNative) &&
+	    (ctx.conv->targetFaces != 6 || ctx.order != OrderRows || ctx.maxMemory)) {
+		fputs(ESC_RED "Face layouts only apply to cube map targets, without traversal orders or streaming\n"
+		      ESC_DEFAULT, stderr);
+		return 1;
+	}
+
+	std::vector<Frame> frames;
+	std::vector<char *> names;
+	for (int i = optind; i != argc; i += 2)
+		frames.push_back(Frame{argv[i], argv[i + 1], Image(), 0, Image(), OutputMap(), false, FaceLayout()});
+	for (const char *list: lists)
+		if (!readList(list, frames, names)) {
+			fprintf(stderr, ESC_RED "Error reading batch list %s\n" ESC_DEFAULT, list);
+			return 1;
+		}
+	for (const char *pattern: globs)
+		if (!readGlob(pattern, outputDir, frames, names)) {
+			fprintf(stderr, ESC_RED "No input matching %s\n" ESC_DEFAULT, pattern);
+			return 1;
+		}
+
+	ctx.pool.start(jobs, true);
+	// The benchmark renders the unrotated synthetic source
+	if (benchHeight && !ctx.orient.identity()) {
+		fputs(ESC_RED "Rotations do not apply to --bench\n" ESC_DEFAULT, stderr);
+		return 1;
+	}
+	if (benchHeight && (ctx.layout != LayoutStrip || ctx.faceOrientation != FacesNative)) {
+		fputs(ESC_RED "Face layouts do not apply to --bench\n" ESC_DEFAULT, stderr);
+		return 1;
+	}
+	if (benchHeight)
+		return bench(&ctx, benchHeight, iterations, json);
+	if (trace && !ctx.trace.open(trace, traceFormat)) {
+		fprintf(stderr, ESC_RED "Error creating trace %s\n" ESC_DEFAULT, trace);
+		return 1;
+	}
+	ctx.encoders.start(jobs);
+	double tStart = monotonic();
+	int ret = convert(&ctx, frames);
+	double tEnd = monotonic();
+	if (ret == 0 && frames.size() > 1)
+		printf(ESC_GREEN "Converted %zu image(s) in %.6f, %.2f image(s)/s\n" ESC_DEFAULT,
+		       frames.size(), tEnd - tStart, frames.size() / (tEnd - tStart));
+	ctx.trace.span("total", 0, 0, tStart, tEnd, SpanCounters());
+	if (!ctx.trace.close()) {
+		fprintf(stderr, ESC_RED "Error writing trace %s\n" ESC_DEFAULT, trace);
+		ret = ret ? ret : 3;
+	}
+	for (char *name: names)
+		free(name);
+	return ret;
 }
 /* }}} */